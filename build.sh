@@ -4,11 +4,17 @@
 : ${BIN=libremotestream.so}
 
 CFLAGS="$CFLAGS -fPIC -Ilib/lite-xl/resources/include -Ilib/zstd/lib"
-LDFLAGS=""
+LDFLAGS="-lpthread"
+# the client looks SDL up in the process it's loaded into, to wake its event loop; see SWaker.
+[[ "$BIN" != *.dll ]] && LDFLAGS="$LDFLAGS -ldl"
+
+# `./build.sh benchmark` builds remotestream-benchmark instead, which replays recorded traces; see the end of libremotestream.c.
+[[ "$1" == "benchmark" ]] && shift && BENCHMARK=1
 
 if [[ ! -e "zstd.o" ]]; then
   cd lib/zstd/build/single_file_libs && ./combine.sh -r ../../lib -x legacy/zstd_legacy.h -k zstd.h -o zstd.c zstd-in.c && $CC -c $CFLAGS $@ zstd.c -o ../../../../zstd.o;  cd -
 fi
 
 [[ "$@" == "clean" ]] && rm -f *.so *.dll *.o && exit 0
+[[ -n "$BENCHMARK" ]] && { $CC $CFLAGS -DLIBREMOTE_BENCHMARK libremotestream.c zstd.o $@ -o remotestream-benchmark $LDFLAGS -lm; exit $?; }
 $CC $CFLAGS libremotestream.c zstd.o $@ -shared -o $BIN $LDFLAGS
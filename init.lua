@@ -5,24 +5,86 @@ local core = require "core"
 local config = require "core.config"
 local style = require "core.style"
 local common = require "core.common"
+local command = require "core.command"
 local libremote = require "plugins.remote.libremotestream"
 
 local DEFAULT_PORT = 8086
 
+config.plugins.remote = common.merge({
+  -- log2 of the zstd window each end keeps for the connection's stream; the smaller of the two ends' values is used.
+  window_log = 20,
+  -- path to a zstd dictionary; used if both ends have the same one, otherwise the server sends its own to the client.
+  dictionary = nil,
+  -- keep packet contents in memory, so that remote:train-dictionary has something to train on.
+  capture_samples = false,
+  -- bytes of text runs each end remembers, so that repeated text is sent as an id; the smaller of the two ends' values is used.
+  string_table_size = 4 * 1024 * 1024,
+  -- server only; send each frame's opcodes, coordinates, colors and text as separate runs, which can compress better.
+  columnar_commands = false,
+  -- client only; where fonts received from servers are kept, by the hash of their contents, so they're only ever sent once.
+  font_cache = nil,
+  -- seconds a session is kept after its last client disconnects, for it to reconnect and carry on where it left off.
+  resume_grace = 30,
+  -- zstd level packets start out compressed at; fonts are always compressed at a high level, as they're only sent once.
+  compression_level = 1,
+  -- raise the level while the link can't keep up, and lower it while compressing is what holds packets up.
+  adaptive_compression = true,
+  -- path to record a trace of the session to from the start, which remotestream-benchmark can replay; see remote:record-trace.
+  trace = nil,
+  -- server only; where to listen. A "unix:///path" address listens on a unix domain socket instead, which clients on
+  -- the same machine can connect to with unix:///path, or with shm:///path to have packets go through shared memory.
+  address = nil,
+  -- client only; draw what's typed at the caret straight away, instead of waiting for the server to send it back.
+  local_echo = true,
+  -- server only; text widths remembered, so the same text isn't measured again each frame. 0 turns it off.
+  width_cache_size = 16384,
+  -- server only; leave out of frames what can't be seen, and merge rects drawn side by side, before sending them.
+  optimize_commands = true,
+  -- server only; frames sent to a client ahead of the ones it's drawn. Frames drawn while it's that far behind are held
+  -- back, and only the newest is sent once it catches up, so what it shows lags by a round trip at most. 0 turns it off.
+  frame_credit = 2
+}, config.plugins.remote)
+
+local function add_trace_commands(log, session)
+  command.add(nil, {
+    ["remote:record-trace"] = function()
+      core.command_view:enter("Record Trace To", {
+        text = USERDIR .. PATHSEP .. os.date("remote-%Y%m%d-%H%M%S.trace"),
+        submit = function(path)
+          local status, err = pcall(session.record, session, path)
+          if not status then return core.error("Can't record trace: %s", err) end
+          log("Recording trace to " .. path .. ".")
+        end
+      })
+    end,
+    ["remote:stop-trace"] = function()
+      session:record()
+      log("Stopped recording trace.")
+    end
+  })
+end
+
 
 if config.plugins.remote.server then
   local function log(msg)
     print(os.date("[SERVER][%Y-%m-%dT%H:%M:%S]: ") .. msg)
   end
-  log("Remote server listening on " .. (config.plugins.remote.address or "localhost") .. ":" .. (config.plugins.remote.port or DEFAULT_PORT) .. ".")
-  local server = libremote.server(config.plugins.remote.address, config.plugins.remote.port or DEFAULT_PORT)
+  local address = config.plugins.remote.address or "localhost"
+  log("Remote server listening on " .. (address:find("^unix://") and address or (address .. ":" .. (config.plugins.remote.port or DEFAULT_PORT))) .. ".")
+  local server = libremote.server(config.plugins.remote.address, config.plugins.remote.port or DEFAULT_PORT, config.plugins.remote)
+
+  add_trace_commands(log, server)
 
   local delayed_registered_fonts = {}
+  local font_contents = {}
+  local accepted = false
 
   local function register_font(font, options)
-    if server:is_open() then
-      log("Transferring " .. font:get_path())
-      server:register_font(font:get_path(), io.open(font:get_path(), "rb"):read("*all"), font, font:get_size(), options and common.serialize(options) or nil)
+    -- fonts loaded while nobody's connected are still registered, so they're sent to whoever resumes the session.
+    if accepted then
+      local path = font:get_path()
+      if not font_contents[path] then font_contents[path] = io.open(path, "rb"):read("*all") end
+      server:register_font(path, font_contents[path], font, font:get_size(), options and common.serialize(options) or nil)
     end
     return font
   end
@@ -54,11 +116,28 @@ if config.plugins.remote.server then
   config.transitions = false
 
   function renderer.draw_rect(...) return server:draw_rect(...) end
-  function renderer.draw_text(font, text, x, ...) server:draw_text(font, text, x, ...) return x + font:get_width(text) end
+  function renderer.draw_text(...) return server:draw_text(...) end
+  -- widths are cached on the server, which draw_text measures with too; the original get_width is what fills it, and
+  -- what measures anything with more arguments than that.
+  function renderer.font.get_width(font, text, ...) return server:get_width(font, text, ...) end
   function renderer.begin_frame(...) return server:begin_frame(...) end
   function renderer.end_frame(...) return server:end_frame(...) end
   function renderer.set_clip_rect(...) return server:set_clip_rect(...) end
 
+  -- tells clients where typing in the active document goes, which they draw before it's come back from us.
+  local DocView = require "core.docview"
+  local old_draw_overlay = DocView.draw_overlay
+  function DocView:draw_overlay(...)
+    if core.active_view == self and #self.doc.selections == 4 then
+      local line1, col1, line2, col2 = self.doc:get_selection()
+      if line1 == line2 and col1 == col2 then
+        local x, y = self:get_line_screen_position(line1, col1)
+        server:set_caret(x, y, style.caret_width, self:get_line_height(), self:get_font(), style.syntax["normal"] or style.text, style.caret)
+      end
+    end
+    return old_draw_overlay(self, ...)
+  end
+
   local old_poll_event = system.poll_event
   system.poll_event = function(...) 
   
@@ -71,22 +150,58 @@ if config.plugins.remote.server then
     return table.unpack(result)
   end
 
+  local disconnected_at, restarting
+  -- anyone else who connects watches along; input only comes from the first client. Called whenever we've waited, as
+  -- that's when someone connecting, or the last client going away, wakes us.
+  local function check_viewers()
+    local status, viewer, resumed = pcall(server.accept, server, false)
+    if not status then
+      log("Can't accept viewer: " .. viewer)
+    elseif viewer then
+      log((resumed and "Resumed session for " or "Accepted viewer from ") .. viewer .. ".")
+      disconnected_at = nil
+      system.set_window_size(core.window, system.get_window_size(core.window))
+      core.redraw = true
+    end
+    if not server:is_open() then
+      if not disconnected_at then
+        log("All clients disconnected; keeping the session for " .. config.plugins.remote.resume_grace .. " seconds.")
+        disconnected_at = system.get_time()
+      elseif system.get_time() - disconnected_at > config.plugins.remote.resume_grace then
+        restarting = true
+        command.perform("core:restart")
+      end
+    end
+  end
+
   function system.wait_event(timeout)
-    return server:wait_event(timeout)
+    -- while nobody's connected, we wake up in time to see the grace period out.
+    if disconnected_at and not restarting then
+      local remaining = math.max(disconnected_at + config.plugins.remote.resume_grace - system.get_time(), 0)
+      timeout = timeout and math.min(timeout, remaining) or remaining
+    end
+    local woken = server:wait_event(timeout)
+    if accepted and not restarting then check_viewers() end
+    return woken
   end
+
+  command.add(nil, {
+    ["remote:train-dictionary"] = function()
+      local path = config.plugins.remote.dictionary or (USERDIR .. PATHSEP .. "remote.dict")
+      local status, dictionary = pcall(server.train_dictionary, server)
+      if not status then return core.error("Can't train dictionary: %s", dictionary) end
+      io.open(path, "wb"):write(dictionary):close()
+      log("Wrote " .. #dictionary .. " byte dictionary to " .. path .. ".")
+    end
+  })
   
   local status, err = pcall(function()
     local client = server:accept()
     log("Accepted client from " .. client .. ".")
+    accepted = true
     for i,v in ipairs(delayed_registered_fonts) do register_font(table.unpack(v)) end
     system.set_window_size(core.window, system.get_window_size(core.window))
     core.redraw = true
-    core.add_thread(function()
-      while server:is_open() do
-        coroutine.yield(0.1)
-      end
-      command.perform("core:restart")
-    end)
   end)
   if not status then  
     io.stderr:write(err, "\n")
@@ -96,26 +211,40 @@ else
   local function log(msg)
     print(os.date("[CLIENT][%Y-%m-%dT%H:%M:%S]: ") .. msg)
   end
-  local total_fonts = 0
-  local function font_load(path, contents, idx, size, options)
-    log("Receiving font " .. path .. " (" .. idx .. ")")
-    local path = "/tmp/font-" .. idx
-    io.open(path, "wb"):write(contents):close()
+  local font_cache = config.plugins.remote.font_cache or (USERDIR .. PATHSEP .. "remote-fonts")
+  common.mkdirp(font_cache)
+  -- returns nil if we don't have the font's contents yet; we're called again once they've been received.
+  local function font_load(path, hash, idx, size, options, contents)
+    local cached = font_cache .. PATHSEP .. hash
+    if contents then
+      log("Received font " .. path .. " (" .. #contents .. " bytes)")
+      -- written under another name first, so that a partially written file is never taken for a cached one. Renaming
+      -- onto a file fails on Windows, but then it's already cached, by another instance.
+      io.open(cached .. ".tmp", "wb"):write(contents):close()
+      if not os.rename(cached .. ".tmp", cached) then os.remove(cached .. ".tmp") end
+    elseif not system.get_file_info(cached) then
+      log("Requesting font " .. path .. " (" .. idx .. ")")
+      return nil
+    end
     if options then
       options = load("return " .. options)()
     end
-    return renderer.font.load(path, size, options)
+    return renderer.font.load(cached, size, options)
   end
   
   local address, port
   for i = 1, #ARGS do
     address, port = ARGS[i]:match("remote://([^:]+):?(%d*)")
+    -- local connections keep the whole url, which is what tells the library how to connect.
+    if not address and (ARGS[i]:find("^unix://.") or ARGS[i]:find("^shm://.")) then address, port = ARGS[i], nil end
     if address then table.remove(ARGS, i) break end
   end
   if address then
-    local status, client = pcall(libremote.client, address, port and port ~= "" and port or DEFAULT_PORT)
+    port = port and port ~= "" and port or DEFAULT_PORT
+    local status, client = pcall(libremote.client, address, port, config.plugins.remote)
     if not status then io.stderr:write(client, "\n") os.exit(-1) end
-    log("Connected to " .. address .. ":" .. (port and port ~= "" and port or DEFAULT_PORT))
+    log("Connected to " .. (address:find("://") and address or (address .. ":" .. port)))
+    add_trace_commands(log, client)
     local old_poll_event = system.poll_event
 
     local old_on_event = core.on_event
@@ -135,48 +264,68 @@ else
       end
     end
     
+    -- only start a frame when one actually arrives, so the renderer has nothing to redraw in between.
+    local frame_started = false
+    local function begin_frame()
+      renderer.begin_frame(core.window)
+      frame_started = true
+    end
+
+    -- each attempt blocks while it connects, for up to a couple of seconds, so they're spaced out further and further.
+    local disconnected_at, last_attempt, retry_interval = nil, 0, 1
     function core.step()
       -- handle events
       local did_keymap = false
       local width, height = core.window:get_size()
       -- draw
       if not client:is_open() then 
-        log("Disconnected.") 
-        core.quit(true) 
+        if not disconnected_at then
+          log("Disconnected.")
+          disconnected_at = system.get_time()
+        end
+        if system.get_time() - last_attempt < retry_interval then return false end
+        last_attempt = system.get_time()
+        local status, resumed = pcall(client.reconnect, client)
+        if status then
+          log(resumed and "Reconnected; resumed session." or "Reconnected; started a new session.")
+          disconnected_at, retry_interval = nil, 1
+        elseif system.get_time() - disconnected_at > config.plugins.remote.resume_grace then
+          core.quit(true)
+        else
+          retry_interval = math.min(retry_interval * 2, 8)
+        end
         return true
       end
-      renderer.begin_frame(core.window)
+      frame_started = false
       for type, a,b,c,d in system.poll_event do
         if type == "quit" then core.quit(true) end
         local _, res = core.try(core.on_event, type, a, b, c, d)
         did_keymap = res or did_keymap
       end
-      renderer.end_frame()
+      if frame_started then renderer.end_frame() end
       return true
     end
 
+    -- wakes as soon as either the server sends something, or the window has an event.
     local old_wait_event = system.wait_event
     function system.wait_event(timeout)
-      local time = system.get_time()
-      while time - system.get_time() < (timeout or 0) do
-        if client:has_event() then return true end
-        local had_event = old_wait_event(math.min(timeout, 0.1 / config.fps))
-        if had_event then return true end
-      end
-      return false
+      return client:wait_event(timeout, old_wait_event)
     end
 
     
+    -- local events never reach core.on_event; they're all sent to the server, in one batch per poll.
     function system.poll_event(...)
-      local result = { old_poll_event(...) }
-      if #result > 0 then 
-        if result[1] == "quit" then 
-          return table.unpack(result)
-        else
-          client:send_event(table.unpack(result)) 
-        end
+      while true do
+        local result = { old_poll_event(...) }
+        if #result == 0 then break end
+        if result[1] == "quit" then return table.unpack(result) end
+        -- our window contents can't be relied on anymore; the next frame has to redraw everything, not just what changed.
+        if result[1] == "resized" or result[1] == "exposed" then client:invalidate() end
+        client:send_event(table.unpack(result))
       end
-      return client:process_event(renderer.set_clip_rect, renderer.draw_rect, renderer.draw_text, font_load)
+      client:flush_events()
+      -- scrolled views are moved with renderer.copy_rect, where the renderer has one; otherwise they're redrawn.
+      return client:process_event(renderer.set_clip_rect, renderer.draw_rect, renderer.draw_text, font_load, begin_frame, renderer.copy_rect)
     end
   end
 end
@@ -1,7 +1,24 @@
+// the linux build asks for strict c99, which hides clock_gettime, lstat, mkstemp, h_addr and the like; these bring them back.
+#ifdef __linux__
+  #ifndef _POSIX_C_SOURCE
+    #define _POSIX_C_SOURCE 200809L
+  #endif
+  #ifndef _DEFAULT_SOURCE
+    #define _DEFAULT_SOURCE
+  #endif
+  #ifndef _BSD_SOURCE
+    #define _BSD_SOURCE
+  #endif
+#endif
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <zstd.h>
+#include <zdict.h>
+#define XXH_INLINE_ALL
+#include <common/xxhash.h>
 #include <assert.h>
+#include <time.h>
 #if _WIN32
   #include <winsock2.h>
   #include <windows.h>
@@ -14,6 +31,16 @@
   #include <unistd.h>
   #include <fcntl.h>
   #include <errno.h>
+  #include <poll.h>
+  #include <sys/un.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <stdlib.h>
+  #include <dlfcn.h>
+#endif
+#ifdef __linux__
+  #include <sys/eventfd.h>
+  #define SHARED_MEMORY_TRANSPORT
 #endif
 
 #ifdef LIBREMOTE_STANDALONE
@@ -33,12 +60,106 @@ typedef enum {
   PACKET_NONE,
   PACKET_COMMAND_BUFFER,
   PACKET_FONT_REGISTER,
-  PACKET_EVENT
+  PACKET_EVENT,
+  PACKET_COMMAND_DELTA,
+  PACKET_EVENT_BATCH,
+  PACKET_FONT_REQUEST,
+  PACKET_FONT_BLOB,
+  PACKET_FRAME_ACK,
+  PACKET_INPUT_ACK,
+  PACKET_TYPE_COUNT
 } EPacketType;
 
+static const char* packet_type_names[] = { "none", "command_buffer", "font_register", "event", "command_delta", "event_batch", "font_request", "font_blob", "frame_ack", "input_ack", NULL };
+
+// Packets are sent on the lowest channel that has any queued, a chunk at a time, so a large one only ever holds up
+// packets on other channels by a chunk. Packets on the same channel go out in order.
+typedef enum {
+  CHANNEL_INPUT,
+  CHANNEL_FRAMES,
+  CHANNEL_BULK,
+  CHANNEL_COUNT
+} EChannel;
+
+// Font registrations go with frames, as the frames after them draw with them; only the contents are bulk.
+static EChannel packet_channel(EPacketType type) {
+  switch (type) {
+    case PACKET_EVENT:
+    case PACKET_EVENT_BATCH:
+    case PACKET_FONT_REQUEST:
+    case PACKET_FRAME_ACK:
+    case PACKET_INPUT_ACK:
+      return CHANNEL_INPUT;
+    case PACKET_FONT_BLOB:
+      return CHANNEL_BULK;
+    default:
+      return CHANNEL_FRAMES;
+  }
+}
+
 #define FONT_FALLBACK_MAX 5
+#define PROTOCOL_MAGIC 0x53524c58
+#define PROTOCOL_VERSION 16
+#define DEFAULT_WINDOW_LOG 20
+#define SEND_QUEUE_LENGTH 4
+#define MAX_CHUNK_SIZE (16*1024)
+// a chunk's compressed size is bounded, give or take the end of the zstd frame before it, when the level's changed.
+#define MAX_COMPRESSED_CHUNK_SIZE (ZSTD_COMPRESSBOUND(MAX_CHUNK_SIZE) + 256)
+#define MAX_PACKET_SIZE (64*1024*1024)
+#define CHUNK_CONTINUED 0x80
+#define WAIT_SLICE 0.002
+#define SDL_USER_EVENT 0x8000
+#define DEFAULT_DICTIONARY_SIZE 112640
+#define MAX_DICTIONARY_SIZE (4*1024*1024)
+#define MAX_CAPTURED_SAMPLES_SIZE (16*1024*1024)
+#define MAX_DIRTY_RECTS 32
+#define MAX_COPY_RECTS 8
+#define MIN_SCROLLED_COMMANDS 8
+#define MAX_OCCLUDERS 32
+#define FRAME_REDRAW_ALL 1
+#define FRAME_COLUMNAR 2
+#define FRAME_RESET 4
+#define FRAME_CARET 8
+#define FRAME_SYNC 16
+#define MAX_PREDICTED_LENGTH 256
+#define BATCH_PREDICTED 1
+#define PREDICTION_TIMEOUT 1000000000ULL
+#define VIEWER_NEW 1
+#define VIEWER_BEHIND 2
+#define DEFAULT_FRAME_CREDIT 2
+#define SESSION_TOKEN_SIZE 16
+#define HANDSHAKE_TIMEOUT 2
+#define DEFAULT_COMPRESSION_LEVEL 1
+#define MIN_ADAPTIVE_LEVEL -7
+#define MAX_ADAPTIVE_LEVEL 19
+#define BULK_COMPRESSION_LEVEL 19
+#define ADAPT_INTERVAL 8
+#define MIN_ADAPTIVE_PACKET_SIZE 1024
+#define MIN_ADAPTIVE_COMPRESS_TIME 200000
+#define HISTOGRAM_BUCKETS 20
+#define TRANSPORT_SOCKET 0
+#define TRANSPORT_SHARED_MEMORY 1
+#define RING_SIZE (8*1024*1024)
+#define TRACE_MAGIC 0x54524c58
+#define TRACE_VERSION 1
+#define MAX_CACHED_COLORS 1024
+#define DEFAULT_STRING_TABLE_SIZE (4*1024*1024)
+#define DEFAULT_WIDTH_CACHE_SIZE 16384
+#define WIDTH_CACHE_WAYS 4
+#define MIN_INTERNED_LENGTH 8
+#define MAX_COALESCED_ARGUMENTS 4
+#define FONT_HASH_LENGTH 28
+#define PALETTE_SIZE 256
+#define OP_TYPE_MASK 0x03
+#define OP_PALETTE_COLOR 0x04
+#define OP_SAME_FONTS 0x08
+#define OP_SAME_TAB_SIZE 0x10
+#define OP_INTEGRAL_X 0x20
+// type, compressed length, decompressed length; of a chunk, where the type has CHUNK_CONTINUED set on all but the last.
+#define PACKET_HEADER_SIZE (sizeof(char) + sizeof(int) * 2)
 
-enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT };
+// DRAW_TEXT_REF only exists on the wire; it's a DrawTextCommand whose text is in the string table, with `len` holding its id.
+enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT, DRAW_TEXT_REF };
 
 typedef struct {
   size_t size;
@@ -118,241 +239,3198 @@ static void hash(unsigned *h, const void *data, int size) {
   }
 }
 
+// For whole commands and text runs, which hash() would go through a byte at a time.
+static unsigned int hash_bytes(const void* data, size_t size) {
+  return (unsigned int)XXH64(data, size, 0);
+}
+
+// Identifies font contents; not cryptographic, but the length is part of the key as well.
+static uint64_t hash64(const void* data, size_t size) {
+  const unsigned char* p = data;
+  uint64_t h = 14695981039346656037ULL;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    h = (h ^ word) * 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  while (size--)
+    h = (h ^ *p++) * 1099511628211ULL;
+  h ^= h >> 32;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 29);
+}
+
+static const RenRect unclipped_rect = { 0, 0, 1 << 24, 1 << 24 };
+
+static RenRect intersect_rects(RenRect a, RenRect b) {
+  int x1 = a.x > b.x ? a.x : b.x, y1 = a.y > b.y ? a.y : b.y;
+  int x2 = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+  int y2 = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+  return (RenRect) { x1, y1, x2 > x1 ? x2 - x1 : 0, y2 > y1 ? y2 - y1 : 0 };
+}
+
+static RenRect merge_rects(RenRect a, RenRect b) {
+  int x1 = a.x < b.x ? a.x : b.x, y1 = a.y < b.y ? a.y : b.y;
+  int x2 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+  int y2 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+  return (RenRect) { x1, y1, x2 - x1, y2 - y1 };
+}
+
+// Touching rects count as overlapping, so that they get merged.
+static int rects_overlap(RenRect a, RenRect b) {
+  return b.x <= a.x + a.width && b.x + b.width >= a.x && b.y <= a.y + a.height && b.y + b.height >= a.y;
+}
+
+typedef struct {
+  uint32_t offset;
+  unsigned int hash;
+} SCommandEntry;
+
+// A run of commands drawn under the same clip rect.
+typedef struct {
+  RenRect clip;
+  uint32_t start;
+  uint32_t count;
+  unsigned int hash;
+  int pair;   // index of the region with the same clip in the other frame, or -1.
+  int scroll; // how far down this region's contents moved since the previous frame.
+  int copy;   // 1 + the index of the copy rect this region moves with, or 0.
+} SRegion;
+
 typedef struct {
   array_t buffer;
+  array_t commands; // SCommandEntry for each command in buffer.
+  array_t regions;  // SRegion, only filled in by index_regions.
   unsigned int checksum;
 } SRencache;
 
+// Precedes the payload of PACKET_COMMAND_BUFFER and PACKET_COMMAND_DELTA, followed by dirty_count RenRects and then
+// copy_count SCopyRects. The copies are made first, then the dirty rects redrawn; unless FRAME_REDRAW_ALL is set, in
+// which case everything is. FRAME_CARET means an SCaret follows the rects. FRAME_RESET marks a keyframe, which starts
+// the string table and palette over; the rest is then followed by the new string table size, as a uint32_t.
+// FRAME_SYNC catches a single viewer up: the rest is followed by a uint32_t length and then the string table and
+// palette as they stand, which the viewer takes over once it's decoded the frame, which makes no use of either.
+// input_sequence is how many event batches from the viewer it's sent to had been processed when the frame was drawn.
+// PACKET_INPUT_ACK is just that uint32_t, for predicted input that didn't change the frame.
+typedef struct {
+  uint32_t flags;
+  uint32_t dirty_count;
+  uint32_t copy_count;
+  uint32_t input_sequence;
+} SFrameHeader;
+
+// Moves what's already been drawn inside `rect` down by `dy`, within `rect`; what's left uncovered is among the dirty rects.
+typedef struct {
+  RenRect rect;
+  int32_t dy;
+} SCopyRect;
+
+// Where text typed into the focused document goes, so that the client can draw it before the server's frame with
+// it comes back. The caret's line is as tall as the caret, and is drawn under `clip`.
+typedef struct {
+  RenRect clip;
+  RenRect rect;
+  int32_t font;
+  RenColor text_color;
+  RenColor caret_color;
+} SCaret;
+
+typedef struct {
+  unsigned int hash;
+  uint32_t index;
+} SHashedCommand;
+
+// Text runs either end has already sent or received, so that repeats can be sent as an id.
+// Both ends apply exactly the same inserts, lookups and evictions in the same order, so the ids stay in sync.
+// Links are 1 + the index of the entry they point to, with 0 meaning none.
+typedef struct {
+  char* text;
+  size_t len;
+  unsigned int hash;
+  uint32_t next;  // next entry in the same bucket, or in the free list.
+  uint32_t older;
+  uint32_t newer;
+} SStringEntry;
+
+typedef struct {
+  array_t entries;
+  array_t buckets;
+  uint32_t free;
+  uint32_t oldest;
+  uint32_t newest;
+  size_t memory;
+  size_t max_memory;
+} SStringTable;
+
+// A delta frame is a sequence of these, each followed by insert_count raw commands.
+// Applied in order: copy copy_count commands from the previous frame starting at copy_start, moving them down by
+// `shift`, then append the inserted ones.
+typedef struct {
+  uint32_t copy_start;
+  uint32_t copy_count;
+  int32_t shift;
+  uint32_t insert_count;
+} SDeltaOp;
+
+typedef struct {
+  SDeltaOp op;
+  uint32_t insert_start;
+} SPendingDeltaOp;
+
+// Commands go on the wire as an opcode byte followed by their fields, rather than as they're laid out in memory.
+// Coordinates are zigzag varints relative to the previous command's, and colors are either an index into a palette
+// both ends keep, or literal, replacing whatever was in their slot. With FRAME_COLUMNAR, each of the streams below
+// is written out separately, so that zstd sees similar data next to each other.
+enum { STREAM_OPS, STREAM_COORDS, STREAM_COLORS, STREAM_TEXT, STREAM_COUNT };
+
+// The palette lasts for the whole connection; everything else is reset at the start of each frame.
+typedef struct {
+  RenColor palette[PALETTE_SIZE];
+  RenRect rect;
+  int text_x;
+  int text_y;
+  int fonts[FONT_FALLBACK_MAX];
+  int8_t tab_size;
+  int columnar;
+  array_t streams[STREAM_COUNT];
+} SCommandCodec;
+
+typedef struct {
+  const char* ptr[STREAM_COUNT];
+  const char* end[STREAM_COUNT];
+  int columnar;
+} SCommandReader;
+
 typedef struct {
   int index;
   struct RenFont* font;
 } SFont;
 
+// A width measured by the server's draw_text or get_width. The cache is split into sets of WIDTH_CACHE_WAYS entries,
+// picked by the hash, and the least recently used entry of a set makes way for a new one. Texts are only told apart
+// by hash and length, so they aren't kept.
+typedef struct {
+  uint64_t hash; // of the text, seeded with the fonts it's measured in; 0 if the entry's unused.
+  uint32_t length;
+  uint32_t used; // width_clock as of when it was last looked up.
+  double width;
+} SWidthEntry;
+
+// Exchanged uncompressed by both ends as soon as the connection is established.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t window_log;
+  uint32_t dictionary_id; // 0 if this end has no dictionary.
+  uint32_t string_table_size;
+  uint8_t token[SESSION_TOKEN_SIZE]; // the server's session; a client sends back the one it was given, or zeroes.
+  uint32_t transport; // TRANSPORT_SHARED_MEMORY if this end can, and wants to, use it.
+  uint32_t fonts; // font registrations a client's had from the session it's sending the token of.
+} SHandshake;
+
+typedef struct {
+  EPacketType type;
+  array_t buffer;
+  uint64_t queued_at;
+} SPacket;
+
+// Counters are only ever added to, so that they're cheap enough to always keep; times are in nanoseconds.
+typedef struct {
+  uint64_t packets;
+  uint64_t raw_bytes;
+  uint64_t compressed_bytes;
+  uint64_t time; // spent compressing, or decompressing.
+  uint64_t stall_time;
+} SPacketStats;
+
+// Bucket i counts durations under 2^i microseconds, that didn't fit in the one before; the last one takes the rest.
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} SHistogram;
+
+typedef struct {
+  uint64_t frames;
+  uint64_t skipped_frames; // end_frame calls with nothing changed since the last frame, by checksum.
+  uint64_t deferred_frames; // end_frame calls held back, as no viewer could take another frame yet.
+  uint64_t catch_ups; // whole frames sent to a single viewer that had fallen behind.
+  uint64_t width_hits; // text widths the server had cached, and ones it had to measure.
+  uint64_t width_misses;
+  // commands the server left out of frames: drawn outside their clip, covered by a later opaque rect, rects merged into
+  // the one before, and clip changes that nothing was drawn under, or that changed nothing.
+  uint64_t outside_clip;
+  uint64_t covered;
+  uint64_t merged_rects;
+  uint64_t redundant_clips;
+  uint64_t keyframes;
+  uint64_t commands;
+  uint64_t time; // spent encoding on the server, and decoding and drawing on the client.
+  SHistogram histogram;
+} SFrameStats;
+
+// A trace is an STraceHeader, followed by records, each an STraceRecord and `length` bytes, all in native byte order.
+// Packets are recorded as they are before compression, and frames as the commands the server drew, before they're
+// encoded; that way a trace can be replayed against later versions of either. `time` is in nanoseconds since the
+// trace was started.
+typedef enum {
+  TRACE_SENT = 1,
+  TRACE_RECEIVED,
+  TRACE_FRAME
+} ETraceRecord;
+
+typedef enum {
+  TRACE_SERVER = 1,
+  TRACE_CLIENT
+} ETraceSide;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t protocol_version;
+  uint32_t side;
+  uint64_t started; // seconds since the epoch.
+} STraceHeader;
+
+typedef struct {
+  uint8_t kind;
+  uint8_t type;
+  uint16_t connection;
+  uint32_t length;
+  uint64_t time;
+} STraceRecord;
+
+typedef struct {
+  FILE* file;
+  uint64_t start;
+} STrace;
+
+// a mouse motion or wheel event that later ones of the same kind get folded into before it's sent.
+typedef struct {
+  int name;
+  int count;
+  lua_Number values[MAX_COALESCED_ARGUMENTS];
+  int integer[MAX_COALESCED_ARGUMENTS];
+} SCoalescedEvent;
+
+// How one type of packet is compressed. Unless the level's been fixed, it's adapted to whichever of compressing and
+// sending takes longer: a link that takes longer to carry a packet than it took to compress is the bottleneck, and
+// more CPU can be spent to send fewer bytes; compressing taking longer than that means the opposite. How long the link
+// takes is worked out from its throughput, measured while it stalled us, for as many of the recent packets as it did
+// stall; it's kept up with the rest. Times are in nanoseconds, and averaged over recent packets.
+typedef struct {
+  int level;
+  int fixed;
+  int packets;
+  double compress_time;
+  double stall_time;
+  double compressed_length;
+  double stalled; // the fraction of packets that were.
+  double throughput; // bytes per second the link drained while we were stalled on it; 0 until it's been measured.
+} SCompressionLevel;
+
+typedef struct {
+  uint64_t compress_time;
+  uint64_t stall_time;
+  uint64_t write_time;
+  size_t compressed_length;
+} SSendTiming;
+
+// The packets queued on one channel; the first is the one being sent, of which `sent` bytes have been so far.
+typedef struct {
+  SPacket queue[SEND_QUEUE_LENGTH];
+  int start;
+  int length;
+  size_t sent;
+  int level; // what the first packet is being compressed at, picked when its first chunk went out.
+  SSendTiming timing; // of the first packet's chunks so far.
+} SChannel;
+
+struct SDuplex;
+
+// How packets get from one end to the other. read and write behave like read(2) and write(2) on a non-blocking
+// socket; wait_writable blocks until write can make progress, and returns -1 if it never will.
 typedef struct {
+  int (*read)(struct SDuplex* duplex, void* data, size_t length);
+  int (*write)(struct SDuplex* duplex, const void* data, size_t length);
+  int (*wait_writable)(struct SDuplex* duplex);
+  int compressed; // whether packets are worth compressing at all, which they aren't if they never leave the machine.
+} STransport;
+
+// One direction of the shared memory transport: a single producer, single consumer byte ring that `capacity` bytes
+// follow. head and tail only ever increase, wrapping around at 2^32; capacity is a power of two.
+typedef struct {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t capacity;
+  uint32_t writer_waiting;
+} SRing;
+
+// Outgoing packets are compressed and written by a sender thread, which owns cctx and outgoing_compressed_buffer;
+// everything else belongs to the Lua thread. The sender never closes fd, it sets `failed` and the Lua thread closes it;
+// as both read it, with or without the mutex, it's only ever accessed atomically.
+typedef struct SDuplex {
   int fd;
+  const STransport* transport;
+  ZSTD_CCtx* cctx;
+  ZSTD_DCtx* dctx;
+  int sending;
+  int stopping;
+  int failed;
+  pthread_t sender;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  SChannel channels[CHANNEL_COUNT];
+  int capture_samples;
+  array_t samples;
+  array_t sample_sizes;
   EPacketType incoming_packet_type;
   array_t incoming_compressed_buffer;
+  size_t incoming_offset;
   array_t incoming_buffer;
+  // the chunks received so far of each channel's packet that's still being sent; belongs to the Lua thread.
+  array_t partial[CHANNEL_COUNT];
+  EPacketType partial_type[CHANNEL_COUNT];
+  // packets that have been decompressed, but not handed out yet; SPacket, with buffers reused across packets.
+  array_t received;
+  int received_start;
+  int received_length;
+  int received_allocated;
   array_t outgoing_compressed_buffer;
   array_t outgoing_buffer;
+  // guarded by mutex once the sender's started; applied_level and frame_open belong to the sender.
+  SCompressionLevel levels[PACKET_TYPE_COUNT];
+  int adaptive;
+  int applied_level;
+  int frame_open;
+  SPacketStats sent_stats[PACKET_TYPE_COUNT]; // guarded by mutex, as the sender keeps these.
+  SHistogram send_latency; // from being queued to having been written; guarded by mutex.
+  SPacketStats received_stats[PACKET_TYPE_COUNT];
+  STrace* trace; // shared with whatever else this end has open; only used from the Lua thread.
+  int connection;
+  // for the shared memory transport; the rings and events are incoming first, then outgoing. The events are eventfds,
+  // for data having been written to a ring, and for space having been freed in it. fd stays open alongside, to notice
+  // the other end going away.
+  void* shared;
+  size_t shared_size;
+  SRing* rings[2];
+  uint32_t ring_capacity; // as mapped; the rings' own copies are the other end's to change, and so never relied on.
+  int events[4];
 } SDuplex;
 
+// Wakes the renderer out of waiting for its window's events once something's arrived from the other end, by pushing it
+// an SDL user event, which it drops. Plugins aren't linked against SDL, so SDL_PushEvent is looked up in the process;
+// it's safe to call from any thread. While armed, the waker's thread polls `watched`, followed by the read end of
+// `cancel`, which disarming writes to, to get it out of poll.
+typedef struct {
+  int (*push_event)(void* event);
+  int started; // -1 if there's no SDL_PushEvent to be found.
+  int stopping;
+  int armed;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct pollfd watched[3];
+  int watched_count;
+  int cancel[2];
+} SWaker;
+
+// One attached client. The first one is the input owner; everyone else only watches.
 typedef struct {
   SDuplex duplex;
+  char address[64];
+  int string_table_size;
+  int stale; // VIEWER_NEW or VIEWER_BEHIND, if it has to be sent a keyframe before it can follow deltas.
+  array_t event_batch;
+  size_t event_offset;
+  uint32_t input_sequence; // event batches received, whether or not they're handed out as events.
+  uint32_t acked_sequence; // input_sequence as of the last frame or input ack sent.
+  uint32_t predicted_sequence; // the last event batch it predicted text input in, which it's owed an ack for.
+  uint32_t sent_frames; // frames sent, and how many of them it's acked drawing.
+  uint32_t acked_frames;
+} SViewer;
+
+// A connection accepted without waiting, that hasn't sent its handshake yet.
+typedef struct {
+  int fd;
+  uint64_t accepted_at;
+  char address[64];
+} SPendingConnection;
+
+// Every frame is encoded once, against state all viewers share, and then sent to each of them.
+typedef struct {
+  array_t viewers; // SViewer*
+  array_t pending; // SPendingConnection
   int listening;
+  int capture_samples;
+  int keyframe;
+  int frame_credit; // frames a viewer can have sent that it hasn't acked; 0 for no limit.
+  int deferred; // whether the frame in rencache was held back for want of credit, to go out once there is some.
+  int window_log;
+  int string_table_size;
+  SStringTable strings;
+  array_t dictionary;
   array_t registered_fonts;
+  array_t font_slots;
+  array_t font_heights;
   SRencache rencache;
-  unsigned int previous_rencache_checksum;
+  SRencache previous_rencache;
+  array_t delta_table;
+  array_t delta_ops;
+  array_t dirty_rects;
+  array_t copy_rects;
+  array_t region_moves;
+  array_t sorted_previous;
+  array_t sorted_current;
+  array_t scroll_offsets;
+  array_t shifted_command;
+  int optimize_commands;
+  SRencache optimized; // what optimize_frame writes the frame it's optimizing out to.
+  array_t visible_rects;
+  RenRect clip;
+  SCaret caret;
+  int has_caret;
+  SWidthEntry* widths;
+  size_t width_sets;
+  uint32_t width_clock;
+  int measure; // the renderer's own font get_width, which measures what the cache doesn't have.
+  SCommandCodec codec;
+  int font_blobs;
+  int font_hashes;
+  array_t font_registrations; // each a size_t length, followed by the PACKET_FONT_REGISTER payload.
+  uint8_t token[SESSION_TOKEN_SIZE];
+  SCompressionLevel compression_levels[PACKET_TYPE_COUNT]; // what each new viewer starts out with.
+  int adaptive_compression;
+  SFrameStats stats;
+  STrace trace;
+  int connections;
+  char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)]; // set if listening on a unix domain socket, which is removed again once we're done.
+  array_t outgoing_buffer;
+  array_t fanout_buffer;
 } SServer;
 
 typedef struct {
   SDuplex duplex;
   int font_table;
+  int color_table;
+  int cached_colors;
   array_t registered_fonts;
+  array_t font_heights;
+  int redraw_all;
+  array_t dirty_rects;
+  array_t copy_rects;
+  SStringTable strings;
+  SRencache rencache;
+  SRencache next_rencache;
+  array_t event_batch;
+  SCoalescedEvent coalesced;
+  SCommandCodec codec;
+  int pending_fonts;
+  char hostname[256];
+  int port;
+  int window_log;
+  int string_table_size;
+  array_t dictionary;
+  uint8_t token[SESSION_TOKEN_SIZE];
+  SFrameStats stats;
+  STrace trace;
+  int connections;
+  // local echo: text typed since the last frame, drawn at the caret that frame had until a frame with it comes back.
+  // Each byte of `predicted` has the number of the event batch it went out in in `predicted_sequences`.
+  int local_echo;
+  uint32_t input_sequence; // event batches sent.
+  uint32_t acked_sequence; // event batches the server had processed as of the last frame.
+  uint32_t received_frames; // acked to the server as they're drawn.
+  uint32_t font_registrations; // received in this session, so that on resuming, only the ones since are sent.
+  uint32_t suspend_sequence; // nothing's predicted until the server's processed this many, after input we can't predict.
+  SCaret caret;
+  int has_caret;
+  array_t predicted;
+  array_t predicted_sequences;
+  uint64_t predicted_time;
+  int echo_pending; // whether `predicted` has changed since it was drawn.
+  RenRect echo_rect; // what the drawn prediction covers, which has to be redrawn once it's dropped.
+  SWaker waker;
 }  SClient;
 
 
-static int get_font_index(SServer* server, struct RenFont* font) {
-  for (int i = 0; i < server->registered_fonts.length / server->registered_fonts.size; ++i) {
-    if (((SFont*)server->registered_fonts.data)[i].font == font)
-      return ((SFont*)server->registered_fonts.data)[i].index;
+// `font`'s slot in `slots`, an open addressing table of registered fonts by their RenFont*; empty if it isn't there.
+static SFont* font_slot(array_t* slots, struct RenFont* font) {
+  size_t mask = slots->length / sizeof(SFont) - 1;
+  size_t i = (size_t)(((uint64_t)(uintptr_t)font >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+  while (((SFont*)slots->data)[i].font && ((SFont*)slots->data)[i].font != font)
+    i = (i + 1) & mask;
+  return &((SFont*)slots->data)[i];
+}
+
+// Rebuilds the table get_font_index looks fonts up in, after a font's been registered; it's kept at most half full. A
+// font registered more than once is known by its last index, as it's a new font that was loaded where an old one was
+// freed.
+static void index_fonts(SServer* server) {
+  size_t count = server->registered_fonts.length / sizeof(SFont), slots = 16;
+  while (slots < count * 2)
+    slots <<= 1;
+  array_reserve(&server->font_slots, slots * sizeof(SFont));
+  memset(server->font_slots.data, 0, slots * sizeof(SFont));
+  server->font_slots.length = slots * sizeof(SFont);
+  for (size_t i = 0; i < count; ++i) {
+    SFont* font = &((SFont*)server->registered_fonts.data)[i];
+    *font_slot(&server->font_slots, font->font) = *font;
   }
-  return -1;
 }
 
+static int get_font_index(SServer* server, struct RenFont* font) {
+  if (!server->font_slots.length)
+    return -1;
+  SFont* slot = font_slot(&server->font_slots, font);
+  return slot->font ? slot->index : -1;
+}
 
 
-static int send_compressed_buffer(SDuplex* duplex, EPacketType type, array_t* buffer) {
-  if (!duplex->fd) {
-    array_clear(buffer);
+
+// Returns the path of the unix domain socket `address` names, if it's a unix:// or shm:// one, and which transport it asks for.
+static const char* local_socket_path(const char* address, int* transport) {
+  *transport = strncmp(address, "shm://", 6) == 0 ? TRANSPORT_SHARED_MEMORY : TRANSPORT_SOCKET;
+  if (*transport == TRANSPORT_SHARED_MEMORY)
+    return &address[6];
+  return strncmp(address, "unix://", 7) == 0 ? &address[7] : NULL;
+}
+
+// Removes the unix domain socket at `path`, and only if that's what's there; a listen address that was mistyped, or
+// pointed at a file on purpose, never deletes it.
+static void unlink_socket(const char* path) {
+  struct stat path_stat;
+  if (!lstat(path, &path_stat) && S_ISSOCK(path_stat.st_mode))
+    unlink(path);
+}
+
+static int socket_read(SDuplex* duplex, void* data, size_t length) {
+  return read(duplex->fd, data, length);
+}
+
+static int socket_write(SDuplex* duplex, const void* data, size_t length) {
+  return write(duplex->fd, data, length);
+}
+
+static int socket_wait_writable(SDuplex* duplex) {
+  struct pollfd pfd = { duplex->fd, POLLOUT, 0 };
+  poll(&pfd, 1, -1);
+  return 0;
+}
+
+static const STransport socket_transport = { socket_read, socket_write, socket_wait_writable, 1 };
+
+#ifdef SHARED_MEMORY_TRANSPORT
+static void signal_event(int event) {
+  uint64_t one = 1;
+  if (write(event, &one, sizeof(one))) {}
+}
+
+static void clear_event(int event) {
+  uint64_t count;
+  if (read(event, &count, sizeof(count))) {}
+}
+
+// Runs on the Lua thread.
+static int ring_read(SDuplex* duplex, void* data, size_t length) {
+  SRing* ring = duplex->rings[0];
+  uint32_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    clear_event(duplex->events[0]);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  }
+  if (head == tail) {
+    // the socket carries nothing anymore, so anything readable on it means it's been closed.
+    char byte;
+    if (recv(duplex->fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) == 0)
+      return 0;
+    errno = EAGAIN;
     return -1;
   }
-  size_t length = array_reserve(&duplex->outgoing_compressed_buffer, ZSTD_compressBound(buffer->length) + sizeof(int) + sizeof(char));
-  duplex->outgoing_compressed_buffer.data[0] = type;
-  size_t compressed_length = ZSTD_compress(&duplex->outgoing_compressed_buffer.data[sizeof(char) + sizeof(int)], length - sizeof(char) - sizeof(int), buffer->data, buffer->length, 1);
-  array_shift(buffer, buffer->length);
-  *((int*)&duplex->outgoing_compressed_buffer.data[sizeof(char)]) = compressed_length;
-  int written;
-  int to_write_length = compressed_length + sizeof(char) + sizeof(int);
-  int written_length = 0;
-  do {
-    int written = write(duplex->fd, &duplex->outgoing_compressed_buffer.data[written_length], to_write_length - written_length);
-    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-      close(duplex->fd);
-      duplex->fd = 0;
-      break;
-    } else if (written < 0)
-      usleep(10000);
-    else
-      written_length += written;
-  } while (written_length < to_write_length);
-  return written_length;
+  // the other end can write anything to the ring, which must never get us to read outside of it.
+  uint32_t capacity = duplex->ring_capacity;
+  if (head - tail > capacity) {
+    errno = EPROTO;
+    return -1;
+  }
+  const char* buffer = (const char*)(ring + 1);
+  size_t available = head - tail, count = length < available ? length : available;
+  size_t offset = tail & (capacity - 1), first = count < capacity - offset ? count : capacity - offset;
+  memcpy(data, &buffer[offset], first);
+  memcpy((char*)data + first, buffer, count - first);
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->writer_waiting, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST);
+    signal_event(duplex->events[1]);
+  }
+  return count;
 }
 
-static int recv_compressed_buffer(SDuplex* duplex) {
-  if (!duplex->fd)
+// Runs on the sender thread.
+static int ring_write(SDuplex* duplex, const void* data, size_t length) {
+  SRing* ring = duplex->rings[1];
+  uint32_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST), capacity = duplex->ring_capacity;
+  if (head - tail > capacity) {
+    errno = EPROTO;
     return -1;
-  int length = read(duplex->fd, &duplex->incoming_compressed_buffer.data[duplex->incoming_compressed_buffer.length], duplex->incoming_compressed_buffer.capacity - duplex->incoming_compressed_buffer.length);
-  if (length < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
-    close(duplex->fd);
-    duplex->fd = 0;
-    return 0;
   }
-  if (length > 0)
-    duplex->incoming_compressed_buffer.length += length;
-  if (duplex->incoming_compressed_buffer.length < sizeof(char) + sizeof(int))
-    return 1;
-  int total_packet_length = array_reserve(&duplex->incoming_compressed_buffer, *((int*)&duplex->incoming_compressed_buffer.data[sizeof(char)]) + sizeof(char) + sizeof(int));
-  if (duplex->incoming_compressed_buffer.length < total_packet_length)
-    return 1;
-  duplex->incoming_packet_type = *duplex->incoming_compressed_buffer.data;
-  size_t decompressed_size = array_reserve(&duplex->incoming_buffer, ZSTD_getFrameContentSize(&duplex->incoming_compressed_buffer.data[sizeof(char) + sizeof(int)], total_packet_length - sizeof(char) - sizeof(int)));
-  size_t decompressed_length = ZSTD_decompress(duplex->incoming_buffer.data, duplex->incoming_buffer.capacity, &duplex->incoming_compressed_buffer.data[sizeof(char) + sizeof(int)], total_packet_length - sizeof(char) - sizeof(int));
-  if (ZSTD_isError(decompressed_length)) {
-    fprintf(stderr, "Error: %d %s\n", decompressed_size, ZSTD_getErrorName(decompressed_length));
-    close(duplex->fd);
-    duplex->fd = 0;
-    return 0;
+  size_t space = capacity - (head - tail), count = length < space ? length : space;
+  if (!count) {
+    errno = EAGAIN;
+    return -1;
   }
-  duplex->incoming_buffer.length = decompressed_length;
-  array_shift(&duplex->incoming_compressed_buffer, total_packet_length);
-  return 1;
+  char* buffer = (char*)(ring + 1);
+  size_t offset = head & (capacity - 1), first = count < capacity - offset ? count : capacity - offset;
+  memcpy(&buffer[offset], data, first);
+  memcpy(buffer, (const char*)data + first, count - first);
+  __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+  signal_event(duplex->events[2]);
+  return count;
 }
 
-#define LUA_TINTEGER 200
-static void push_lua(lua_State* L, int n, array_t* buffer) {
-  array_append(buffer, &n, sizeof(n));
-  for (int i = -n; i < 0; ++i) {
-    int type = lua_type(L, i);
-    if (type == LUA_TNUMBER && lua_isinteger(L, i))
-      type = LUA_TINTEGER;
-    array_append(buffer, &type, sizeof(type));
-    switch (type) {
-      case LUA_TNIL: break;
-      case LUA_TSTRING: {
-        size_t len;
-        const char* str = lua_tolstring(L, i, &len);
-        array_append(buffer, &len, sizeof(len));
-        array_append(buffer, str, len);
-      } break;
-      case LUA_TINTEGER: {
-        int n = lua_tointeger(L, i);
-        array_append(buffer, &n, sizeof(n));
-      } break;
-      case LUA_TNUMBER: {
-        double n = lua_tonumber(L, i);
-        array_append(buffer, &n, sizeof(n));
-      } break;
-      case LUA_TBOOLEAN: {
-        char c = lua_toboolean(L, i);
-        array_append(buffer, &c, sizeof(c));
-      } break;
-    }
-  }
-  lua_pop(L, n);
+static int ring_wait_writable(SDuplex* duplex) {
+  SRing* ring = duplex->rings[1];
+  // the reader only signals space once it's seen we're waiting for it, so check again after saying so.
+  __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+  uint32_t used = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+  if (used != duplex->ring_capacity)
+    return used < duplex->ring_capacity ? 0 : -1;
+  struct pollfd pfds[2] = { { duplex->events[3], POLLIN, 0 }, { duplex->fd, 0, 0 } };
+  poll(pfds, 2, -1);
+  clear_event(duplex->events[3]);
+  return pfds[1].revents & (POLLHUP | POLLERR) ? -1 : 0;
 }
 
-static int pull_lua(lua_State* L, array_t* buffer) {
-  int arg_count = 0;
-  
-  const char* cmd_ptr = buffer->data;
-  const char* end = buffer->data + buffer->length;
-  
-  if (cmd_ptr < end) {
-    arg_count = *((int*)cmd_ptr);
-    cmd_ptr += sizeof(int);
-    for (int i = 0; i < arg_count; ++i) {
-      int type = *((int*)cmd_ptr);
-      cmd_ptr += sizeof(int);
-      switch (type) {
-        case LUA_TNIL:
-          lua_pushnil(L);
-        break;
-        case LUA_TINTEGER:
-          lua_pushinteger(L, *(int*)cmd_ptr);
-          cmd_ptr += sizeof(int);
-        break;
-        case LUA_TBOOLEAN:
-          lua_pushboolean(L, *cmd_ptr);
-          ++cmd_ptr;
-        break;
-        case LUA_TSTRING: {
-          size_t length = *(size_t*)cmd_ptr;
-          cmd_ptr += sizeof(size_t);
-          lua_pushlstring(L, cmd_ptr, length);
-          cmd_ptr += length;
-        } break;
-        case LUA_TNUMBER:
-          lua_pushnumber(L, *(double*)cmd_ptr);
-          cmd_ptr += sizeof(double);
-        break;
-      }
+static const STransport ring_transport = { ring_read, ring_write, ring_wait_writable, 0 };
+
+// Sends a file descriptor set over a unix domain socket, along with `length` bytes of `data`.
+static int send_fds(int fd, const void* data, size_t length, int* fds, int count) {
+  char control[CMSG_SPACE(sizeof(int) * 8)] = {0};
+  struct iovec iov = { (void*)data, length };
+  struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * count) };
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+  return sendmsg(fd, &message, 0) == (ssize_t)length ? 0 : -1;
+}
+
+static int recv_fds(int fd, void* data, size_t length, int* fds, int count) {
+  char control[CMSG_SPACE(sizeof(int) * 8)] = {0};
+  struct iovec iov = { data, length };
+  struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(sizeof(int) * count) };
+  if (recvmsg(fd, &message, MSG_WAITALL) != (ssize_t)length)
+    return -1;
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  if (!header || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(int) * count))
+    return -1;
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * count);
+  return 0;
+}
+
+// Sets up the rings, once both ends have agreed to use them. The server creates them, and hands them to the client over
+// the socket, along with the events for both directions.
+static int duplex_share_memory(SDuplex* duplex, int creating) {
+  int fds[5] = { -1, -1, -1, -1, -1 }; // memory, then data and space events for server to client, then client to server.
+  uint32_t ring_size = RING_SIZE;
+  if (creating) {
+    char path[] = "/dev/shm/remotestream-XXXXXX", fallback[] = "/tmp/remotestream-XXXXXX";
+    char* name = path;
+    if ((fds[0] = mkstemp(name)) == -1)
+      fds[0] = mkstemp(name = fallback);
+    if (fds[0] == -1)
+      return -1;
+    unlink(name);
+    for (int i = 1; i < 5; ++i) {
+      if ((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        goto error;
     }
+    if (ftruncate(fds[0], 2 * (sizeof(SRing) + ring_size)))
+      goto error;
+  } else if (recv_fds(duplex->fd, &ring_size, sizeof(ring_size), fds, 5) || ring_size < 2 || ring_size > RING_SIZE || (ring_size & (ring_size - 1)))
+    goto error;
+  duplex->shared_size = 2 * (sizeof(SRing) + ring_size);
+  // touching a mapping past the end of the file it's of is a crash, rather than an error.
+  struct stat shared_stat;
+  if (!creating && (fstat(fds[0], &shared_stat) || (size_t)shared_stat.st_size < duplex->shared_size))
+    goto error;
+  duplex->shared = mmap(NULL, duplex->shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (duplex->shared == MAP_FAILED) {
+    duplex->shared = NULL;
+    goto error;
   }
-  return arg_count;
+  SRing* server_to_client = duplex->shared;
+  SRing* client_to_server = (SRing*)((char*)duplex->shared + sizeof(SRing) + ring_size);
+  if (creating) {
+    server_to_client->capacity = client_to_server->capacity = ring_size;
+    if (send_fds(duplex->fd, &ring_size, sizeof(ring_size), fds, 5))
+      goto error;
+  }
+  close(fds[0]);
+  duplex->ring_capacity = ring_size;
+  duplex->rings[0] = creating ? client_to_server : server_to_client;
+  duplex->rings[1] = creating ? server_to_client : client_to_server;
+  int events[4] = { fds[3], fds[4], fds[1], fds[2] };
+  memcpy(duplex->events, creating ? events : &fds[1], sizeof(duplex->events));
+  duplex->transport = &ring_transport;
+  return 0;
+  error:
+  if (duplex->shared)
+    munmap(duplex->shared, duplex->shared_size);
+  duplex->shared = NULL;
+  for (int i = 0; i < 5; ++i) {
+    if (fds[i] != -1)
+      close(fds[i]);
+  }
+  return -1;
 }
+#endif
 
-static int push_command(SRencache* rencache, Command* command) {
-  array_append(&rencache->buffer, command, command->size);
-  hash(&rencache->checksum, command, command->size);
-  return command->size;
+static void duplex_close(SDuplex* duplex) {
+  if (duplex->sending) {
+    pthread_mutex_lock(&duplex->mutex);
+    duplex->stopping = 1;
+    pthread_cond_broadcast(&duplex->cond);
+    pthread_mutex_unlock(&duplex->mutex);
+    // unblocks the sender if it's stuck writing to a peer that's gone away.
+    shutdown(duplex->fd, SHUT_RDWR);
+    pthread_join(duplex->sender, NULL);
+    pthread_mutex_destroy(&duplex->mutex);
+    pthread_cond_destroy(&duplex->cond);
+    duplex->sending = 0;
+  }
+  if (duplex->fd)
+    close(duplex->fd);
+  duplex->fd = 0;
+  if (duplex->shared) {
+    munmap(duplex->shared, duplex->shared_size);
+    for (int i = 0; i < 4; ++i)
+      close(duplex->events[i]);
+    duplex->shared = NULL;
+  }
+  duplex->transport = &socket_transport;
 }
 
-static int f_server_gc(lua_State* L) {
-  SServer* server = lua_touserdata(L, 1);
-  close(server->duplex.fd);
-  free(server->duplex.incoming_buffer.data);
-  free(server->duplex.incoming_compressed_buffer.data);
-  free(server->duplex.outgoing_buffer.data);
-  free(server->duplex.outgoing_compressed_buffer.data);
+// Closes the connection if the sender ran into an error; returns whether it's still open.
+static int duplex_check(SDuplex* duplex) {
+  if (duplex->fd && __atomic_load_n(&duplex->failed, __ATOMIC_ACQUIRE))
+    duplex_close(duplex);
+  return duplex->fd != 0;
 }
 
-static int f_server_register_font(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  const char* path = luaL_checkstring(L, 2);
-  const char* contents = luaL_checkstring(L, 3);
-  struct RenFont* font = *(struct RenFont**)luaL_checkudata(L, 4, "Font");
-  double size = lua_tonumber(L, 5);
-  const char* options = luaL_optstring(L, 6, NULL);
-  SFont sfont = (SFont){ server->registered_fonts.length + 1, font };
-  array_append(&server->registered_fonts, &sfont, sizeof(SFont));
-  lua_pushvalue(L, 2);
-  lua_pushvalue(L, 3);
-  lua_pushinteger(L, sfont.index);
-  lua_pushvalue(L, 5);
-  lua_pushvalue(L, 6);
-  push_lua(L, 5, &server->duplex.outgoing_buffer);
-  send_compressed_buffer(&server->duplex, PACKET_FONT_REGISTER, &server->duplex.outgoing_buffer);
+// Fills in what to poll to find out that there's something to read from the other end, or that it's gone away; returns
+// how many there are. With shared memory, the socket only ever becomes readable when it's closed.
+static int duplex_poll_fds(SDuplex* duplex, struct pollfd* pfds) {
+  pfds[0] = (struct pollfd){ duplex->fd, POLLIN, 0 };
+  #ifdef SHARED_MEMORY_TRANSPORT
+    if (duplex->shared) {
+      pfds[1] = (struct pollfd){ duplex->events[0], POLLIN, 0 };
+      return 2;
+    }
+  #endif
   return 1;
 }
 
-static int f_server_begin_frame(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  array_clear(&server->rencache.buffer);
-  server->rencache.checksum = HASH_INITIAL;
-  return 0;
+static void duplex_free(SDuplex* duplex) {
+  duplex_close(duplex);
+  ZSTD_freeCCtx(duplex->cctx);
+  ZSTD_freeDCtx(duplex->dctx);
+  free(duplex->incoming_buffer.data);
+  free(duplex->incoming_compressed_buffer.data);
+  free(duplex->outgoing_buffer.data);
+  free(duplex->outgoing_compressed_buffer.data);
+  free(duplex->samples.data);
+  free(duplex->sample_sizes.data);
+  for (int i = 0; i < CHANNEL_COUNT; ++i) {
+    for (int j = 0; j < SEND_QUEUE_LENGTH; ++j)
+      free(duplex->channels[i].queue[j].buffer.data);
+    free(duplex->partial[i].data);
+  }
+  for (int i = 0; i < duplex->received_allocated; ++i)
+    free(((SPacket*)duplex->received.data)[i].buffer.data);
+  free(duplex->received.data);
 }
 
-static int f_server_end_frame(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  if (server->rencache.checksum != server->previous_rencache_checksum && server->duplex.fd) {
-    int flags = fcntl(server->duplex.fd, F_GETFL, 0);
-    fcntl(server->duplex.fd, F_SETFL, flags & ~O_NONBLOCK);
-    send_compressed_buffer(&server->duplex, PACKET_COMMAND_BUFFER, &server->rencache.buffer);
-    fcntl(server->duplex.fd, F_SETFL, flags | O_NONBLOCK);
-    server->previous_rencache_checksum = server->rencache.checksum;
-    lua_pushboolean(L, 1);
-  } else 
-    lua_pushboolean(L, 0);
-  return 1;
+// Keeps raw packet payloads around so that a dictionary can be trained on real sessions.
+static void duplex_capture(SDuplex* duplex, const char* data, size_t length) {
+  if (duplex->capture_samples && length && duplex->samples.length + length <= MAX_CAPTURED_SAMPLES_SIZE) {
+    array_append(&duplex->samples, data, length);
+    array_append(&duplex->sample_sizes, &length, sizeof(length));
+  }
 }
 
+static int read_file(const char* path, array_t* contents) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return -1;
+  char chunk[4096];
+  size_t length;
+  while ((length = fread(chunk, sizeof(char), sizeof(chunk), file)) > 0)
+    array_append(contents, chunk, length);
+  fclose(file);
+  return 0;
+}
 
-static int color_value_error(lua_State *L, int idx, int table_idx) {
-  const char *type, *msg;
-  // generate an appropriate error message
-  if (luaL_getmetafield(L, -1, "__name") == LUA_TSTRING) {
-    type = lua_tostring(L, -1); // metatable name
+static uint64_t get_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Bounds how long the next read or write on a blocking socket can wait by what's left until `deadline`, as from
+// get_time; returns -1 if that's already passed. Without a `deadline`, the socket's left as it is.
+static int socket_deadline(int fd, uint64_t deadline) {
+  if (!deadline)
+    return 0;
+  uint64_t now = get_time();
+  if (now >= deadline) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  // a timeout of 0 would be no timeout at all.
+  uint64_t remaining = (deadline - now) / 1000 + 1;
+  struct timeval timeout = { remaining / 1000000, remaining % 1000000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  return 0;
+}
+
+static int write_all(int fd, const void* data, size_t length, uint64_t deadline) {
+  for (size_t written = 0; written < length; ) {
+    if (socket_deadline(fd, deadline))
+      return -1;
+    int result = write(fd, (const char*)data + written, length - written);
+    if (result <= 0)
+      return -1;
+    written += result;
+  }
+  return 0;
+}
+
+// Bounds how long reads and writes on a blocking socket can wait, in seconds; 0 lets them wait for good again.
+static void set_socket_timeout(int fd, int seconds) {
+  struct timeval timeout = { seconds, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static int read_all(int fd, void* data, size_t length, uint64_t deadline) {
+  for (size_t received = 0; received < length; ) {
+    if (socket_deadline(fd, deadline))
+      return -1;
+    int result = read(fd, (char*)data + received, length - received);
+    if (result <= 0)
+      return -1;
+    received += result;
+  }
+  return 0;
+}
+
+static void generate_token(uint8_t* token) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1 || read_all(fd, token, SESSION_TOKEN_SIZE, 0)) {
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)token;
+    for (int i = 0; i < SESSION_TOKEN_SIZE; i += sizeof(seed)) {
+      seed = hash64(&seed, sizeof(seed));
+      memcpy(&token[i], &seed, sizeof(seed));
+    }
+  }
+  if (fd != -1)
+    close(fd);
+}
+
+static void trace_close(STrace* trace) {
+  if (trace->file)
+    fclose(trace->file);
+  trace->file = NULL;
+}
+
+static int trace_open(STrace* trace, const char* path, ETraceSide side) {
+  trace_close(trace);
+  trace->file = fopen(path, "wb");
+  if (!trace->file)
+    return -1;
+  trace->start = get_time();
+  STraceHeader header = { TRACE_MAGIC, TRACE_VERSION, PROTOCOL_VERSION, side, (uint64_t)time(NULL) };
+  if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+    trace_close(trace);
+    return -1;
+  }
+  return 0;
+}
+
+// Stops recording if the trace can't be written to anymore, rather than interrupt the session.
+static void trace_write(STrace* trace, ETraceRecord kind, EPacketType type, int connection, const void* data, size_t length) {
+  if (!trace || !trace->file)
+    return;
+  STraceRecord record = { kind, type, connection, length, get_time() - trace->start };
+  if (fwrite(&record, sizeof(record), 1, trace->file) != 1 || (length && fwrite(data, length, 1, trace->file) != 1)) {
+    fprintf(stderr, "Error: can't write to trace, stopped recording\n");
+    trace_close(trace);
+  }
+}
+
+static void record_duration(SHistogram* histogram, uint64_t duration) {
+  int bucket = 0;
+  for (uint64_t microseconds = duration / 1000; microseconds && bucket < HISTOGRAM_BUCKETS - 1; microseconds >>= 1)
+    ++bucket;
+  ++histogram->counts[bucket];
+}
+
+static void init_compression_levels(SCompressionLevel* levels, int level) {
+  for (int i = 0; i < PACKET_TYPE_COUNT; ++i)
+    levels[i] = (SCompressionLevel){ .level = level };
+  // fonts are sent once and cached for good, so they're worth squeezing no matter what the link's like.
+  levels[PACKET_FONT_BLOB] = (SCompressionLevel){ .level = BULK_COMPRESSION_LEVEL, .fixed = 1 };
+}
+
+// Runs on the sender thread, with the mutex held.
+static void adapt_compression_level(SDuplex* duplex, EPacketType type, size_t length, SSendTiming* timing) {
+  SCompressionLevel* level = &duplex->levels[type];
+  // small packets take next to no time whatever the level, and so say nothing about it.
+  if (length < MIN_ADAPTIVE_PACKET_SIZE)
+    return;
+  level->compress_time += ((double)timing->compress_time - level->compress_time) / 4;
+  level->stall_time += ((double)timing->stall_time - level->stall_time) / 4;
+  level->compressed_length += ((double)timing->compressed_length - level->compressed_length) / 4;
+  level->stalled += ((timing->stall_time ? 1 : 0) - level->stalled) / 4;
+  if (timing->stall_time && timing->write_time)
+    level->throughput += (timing->compressed_length * 1e9 / timing->write_time - level->throughput) / (level->throughput ? 4 : 1);
+  if (!duplex->adaptive || level->fixed || ++level->packets % ADAPT_INTERVAL)
+    return;
+  double link_time = level->throughput ? level->stalled * level->compressed_length * 1e9 / level->throughput : 0;
+  if (level->stall_time > link_time)
+    link_time = level->stall_time;
+  int step = 0;
+  if (link_time > 2 * level->compress_time && level->level < MAX_ADAPTIVE_LEVEL)
+    step = 1;
+  else if (level->compress_time > 2 * link_time && level->compress_time > MIN_ADAPTIVE_COMPRESS_TIME && level->level > MIN_ADAPTIVE_LEVEL)
+    step = -1;
+  level->level += step;
+  // zstd takes 0 to mean its default level, rather than the one between -1 and 1.
+  if (!level->level)
+    level->level += step;
+}
+
+static int compress_stream(SDuplex* duplex, ZSTD_outBuffer* output, ZSTD_inBuffer* input, ZSTD_EndDirective directive) {
+  while (1) {
+    size_t remaining = ZSTD_compressStream2(duplex->cctx, output, input, directive);
+    if (ZSTD_isError(remaining)) {
+      fprintf(stderr, "Error: %s\n", ZSTD_getErrorName(remaining));
+      return -1;
+    }
+    if (!remaining)
+      return 0;
+    array_reserve(&duplex->outgoing_compressed_buffer, duplex->outgoing_compressed_buffer.capacity + ZSTD_CStreamOutSize());
+    output->dst = &duplex->outgoing_compressed_buffer.data[PACKET_HEADER_SIZE];
+    output->size = duplex->outgoing_compressed_buffer.capacity - PACKET_HEADER_SIZE;
+  }
+}
+
+// Runs on the sender thread; waits for as long as the transport takes to accept all of `data`.
+static int write_fully(SDuplex* duplex, const char* data, size_t length, SSendTiming* timing) {
+  size_t written_length = 0;
+  while (written_length < length) {
+    int written = duplex->transport->write(duplex, &data[written_length], length - written_length);
+    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    } else if (written < 0) {
+      uint64_t stalled = get_time();
+      if (duplex->transport->wait_writable(duplex))
+        return -1;
+      timing->stall_time += get_time() - stalled;
+    } else
+      written_length += written;
+  }
+  return 0;
+}
+
+// Runs on the sender thread; writes `length` bytes of a packet of the given type, as one chunk. `more` is whether
+// there's more of the packet to come after it.
+static int write_chunk(SDuplex* duplex, EPacketType type, const char* data, size_t length, int more, int level, SSendTiming* timing) {
+  uint64_t start = get_time();
+  char type_byte = type | (more ? CHUNK_CONTINUED : 0);
+  if (!duplex->transport->compressed) {
+    char header[PACKET_HEADER_SIZE];
+    header[0] = type_byte;
+    *((int*)&header[sizeof(char)]) = length;
+    *((int*)&header[sizeof(char) + sizeof(int)]) = length;
+    timing->compressed_length += length;
+    if (write_fully(duplex, header, PACKET_HEADER_SIZE, timing) || write_fully(duplex, data, length, timing))
+      return -1;
+    timing->write_time += get_time() - start;
+    return 0;
+  }
+  array_reserve(&duplex->outgoing_compressed_buffer, ZSTD_compressBound(length) + PACKET_HEADER_SIZE);
+  ZSTD_inBuffer input = { data, length, 0 };
+  ZSTD_outBuffer output = { &duplex->outgoing_compressed_buffer.data[PACKET_HEADER_SIZE], duplex->outgoing_compressed_buffer.capacity - PACKET_HEADER_SIZE, 0 };
+  if (level != duplex->applied_level) {
+    // zstd only picks up a new level at the start of a frame, so the current one is ended first, which costs the
+    // history built up so far; the receiver simply carries on decompressing into the next frame.
+    ZSTD_inBuffer nothing = { NULL, 0, 0 };
+    if (duplex->frame_open && compress_stream(duplex, &output, &nothing, ZSTD_e_end))
+      return -1;
+    ZSTD_CCtx_setParameter(duplex->cctx, ZSTD_c_compressionLevel, level);
+    duplex->applied_level = level;
+  }
+  // flush, rather than end the frame, so that the stream's history carries over to the next chunk.
+  if (compress_stream(duplex, &output, &input, ZSTD_e_flush))
+    return -1;
+  duplex->frame_open = 1;
+  timing->compress_time += get_time() - start;
+  timing->compressed_length += output.pos;
+  start = get_time();
+  duplex->outgoing_compressed_buffer.data[0] = type_byte;
+  *((int*)&duplex->outgoing_compressed_buffer.data[sizeof(char)]) = output.pos;
+  *((int*)&duplex->outgoing_compressed_buffer.data[sizeof(char) + sizeof(int)]) = length;
+  if (write_fully(duplex, duplex->outgoing_compressed_buffer.data, output.pos + PACKET_HEADER_SIZE, timing))
+    return -1;
+  timing->write_time += get_time() - start;
+  return 0;
+}
+
+// Whether any channel's in the middle of sending a packet; called with the mutex held.
+static int packet_in_flight(SDuplex* duplex) {
+  for (int i = 0; i < CHANNEL_COUNT; ++i) {
+    if (duplex->channels[i].sent)
+      return 1;
+  }
+  return 0;
+}
+
+// The highest priority channel with anything queued, or CHANNEL_COUNT if there's nothing; called with the mutex held.
+static int next_channel(SDuplex* duplex) {
+  int channel = 0;
+  while (channel < CHANNEL_COUNT && !duplex->channels[channel].length)
+    ++channel;
+  return channel;
+}
+
+// Sends a chunk at a time, going back to the queues after each, so that a packet queued on a higher priority channel
+// goes out next, ahead of the rest of whatever's in the middle of being sent.
+static void* duplex_sender(void* data) {
+  SDuplex* duplex = data;
+  pthread_mutex_lock(&duplex->mutex);
+  while (1) {
+    int index;
+    while ((index = next_channel(duplex)) == CHANNEL_COUNT && !duplex->stopping)
+      pthread_cond_wait(&duplex->cond, &duplex->mutex);
+    if (index == CHANNEL_COUNT)
+      break;
+    SChannel* channel = &duplex->channels[index];
+    SPacket* packet = &channel->queue[channel->start];
+    if (!channel->sent) {
+      // changing the level ends zstd's frame, and with it the history built up so far, so it's only changed between
+      // packets, with none partway out on another channel; whatever's interleaved with a packet goes at its level.
+      SCompressionLevel* level = &duplex->levels[packet->type];
+      int own_level = !packet_in_flight(duplex) && (level->fixed || packet->buffer.length >= MIN_ADAPTIVE_PACKET_SIZE);
+      channel->level = own_level ? level->level : duplex->applied_level;
+      channel->timing = (SSendTiming){0};
+    }
+    size_t length = packet->buffer.length - channel->sent;
+    length = length > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : length;
+    int more = channel->sent + length < packet->buffer.length;
+    pthread_mutex_unlock(&duplex->mutex);
+    int failed = __atomic_load_n(&duplex->failed, __ATOMIC_ACQUIRE);
+    if (!failed && write_chunk(duplex, packet->type, &packet->buffer.data[channel->sent], length, more, channel->level, &channel->timing)) {
+      failed = 1;
+      __atomic_store_n(&duplex->failed, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&duplex->mutex);
+    // once anything's failed, what's left is dropped whole.
+    if (more && !failed) {
+      channel->sent += length;
+      continue;
+    }
+    if (!failed) {
+      SSendTiming* timing = &channel->timing;
+      // a packet that went at another level than its own says nothing about that.
+      if (duplex->transport->compressed && channel->level == duplex->levels[packet->type].level)
+        adapt_compression_level(duplex, packet->type, packet->buffer.length, timing);
+      SPacketStats* stats = &duplex->sent_stats[packet->type];
+      ++stats->packets;
+      stats->raw_bytes += packet->buffer.length;
+      stats->compressed_bytes += timing->compressed_length + PACKET_HEADER_SIZE * ((packet->buffer.length + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE + !packet->buffer.length);
+      stats->time += timing->compress_time;
+      stats->stall_time += timing->stall_time;
+      record_duration(&duplex->send_latency, get_time() - packet->queued_at);
+    }
+    array_clear(&packet->buffer);
+    channel->sent = 0;
+    channel->start = (channel->start + 1) % SEND_QUEUE_LENGTH;
+    --channel->length;
+    pthread_cond_broadcast(&duplex->cond);
+  }
+  pthread_mutex_unlock(&duplex->mutex);
+  return NULL;
+}
+
+static int duplex_start_sender(SDuplex* duplex) {
+  pthread_mutex_init(&duplex->mutex, NULL);
+  pthread_cond_init(&duplex->cond, NULL);
+  if (pthread_create(&duplex->sender, NULL, duplex_sender, duplex)) {
+    pthread_mutex_destroy(&duplex->mutex);
+    pthread_cond_destroy(&duplex->cond);
+    return -1;
+  }
+  duplex->sending = 1;
+  return 0;
+}
+
+// Performs the handshake on a freshly connected, still blocking socket, and sets up the streaming contexts.
+// Both ends keep a single zstd stream open for the whole connection, so each packet can reference data from
+// earlier packets; the window is the smaller of what both sides asked for, which bounds the memory either keeps.
+// A dictionary is used if both ends have the same one; otherwise, if we're the `server` and have one, it's sent over.
+// If both ends ask for the shared memory transport, the server then sets it up, and packets go through it uncompressed.
+// `handshake` holds what we ask for going in, and what was agreed on coming out.
+static int duplex_handshake(SDuplex* duplex, SHandshake* handshake, array_t* dictionary, int server) {
+  ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+  int window_log = handshake->window_log;
+  window_log = window_log < bounds.lowerBound ? bounds.lowerBound : (window_log > bounds.upperBound ? bounds.upperBound : window_log);
+  unsigned int dictionary_id = dictionary && dictionary->length ? ZDICT_getDictID(dictionary->data, dictionary->length) : 0;
+  SHandshake local = { PROTOCOL_MAGIC, PROTOCOL_VERSION, window_log, dictionary_id, handshake->string_table_size }, remote;
+  memcpy(local.token, handshake->token, SESSION_TOKEN_SIZE);
+  local.fonts = handshake->fonts;
+  #ifdef SHARED_MEMORY_TRANSPORT
+    local.transport = handshake->transport;
+  #endif
+  duplex->transport = &socket_transport;
+  // the handshake as a whole has to be done in time, however it's spread out, so a peer that trickles it in can't hold
+  // us up for any longer than one that sends nothing at all.
+  uint64_t deadline = get_time() + HANDSHAKE_TIMEOUT * 1000000000ULL;
+  if (write_all(duplex->fd, &local, sizeof(local), deadline) || read_all(duplex->fd, &remote, sizeof(remote), deadline) || remote.magic != PROTOCOL_MAGIC || remote.version != PROTOCOL_VERSION)
+    return -1;
+  memcpy(handshake->token, remote.token, SESSION_TOKEN_SIZE);
+  handshake->fonts = remote.fonts;
+  if (remote.window_log < window_log)
+    window_log = remote.window_log < bounds.lowerBound ? bounds.lowerBound : remote.window_log;
+  handshake->window_log = window_log;
+  handshake->string_table_size = remote.string_table_size < local.string_table_size ? remote.string_table_size : local.string_table_size;
+  array_t shipped = {0};
+  int use_dictionary = dictionary_id && dictionary_id == remote.dictionary_id;
+  if (!use_dictionary && server && dictionary_id) {
+    uint32_t length = dictionary->length;
+    if (write_all(duplex->fd, &length, sizeof(length), deadline) || write_all(duplex->fd, dictionary->data, length, deadline))
+      return -1;
+    use_dictionary = 1;
+  } else if (!use_dictionary && !server && remote.dictionary_id) {
+    uint32_t length;
+    // the length comes from the server, and is only trusted as far as any dictionary we'd train or load could be.
+    if (read_all(duplex->fd, &length, sizeof(length), deadline) || length > MAX_DICTIONARY_SIZE)
+      return -1;
+    shipped.length = array_reserve(&shipped, length);
+    if (read_all(duplex->fd, shipped.data, length, deadline)) {
+      free(shipped.data);
+      return -1;
+    }
+    dictionary = &shipped;
+    use_dictionary = 1;
+  }
+  handshake->dictionary_id = use_dictionary ? (dictionary_id ? dictionary_id : remote.dictionary_id) : 0;
+  handshake->transport = local.transport == TRANSPORT_SHARED_MEMORY && remote.transport == TRANSPORT_SHARED_MEMORY ? TRANSPORT_SHARED_MEMORY : TRANSPORT_SOCKET;
+  #ifdef SHARED_MEMORY_TRANSPORT
+    if (handshake->transport == TRANSPORT_SHARED_MEMORY && (socket_deadline(duplex->fd, deadline) || duplex_share_memory(duplex, server))) {
+      free(shipped.data);
+      return -1;
+    }
+  #endif
+  duplex->cctx = ZSTD_createCCtx();
+  duplex->dctx = ZSTD_createDCtx();
+  ZSTD_CCtx_setParameter(duplex->cctx, ZSTD_c_compressionLevel, DEFAULT_COMPRESSION_LEVEL);
+  duplex->applied_level = DEFAULT_COMPRESSION_LEVEL;
+  duplex->frame_open = 0;
+  ZSTD_CCtx_setParameter(duplex->cctx, ZSTD_c_windowLog, window_log);
+  ZSTD_DCtx_setParameter(duplex->dctx, ZSTD_d_windowLogMax, window_log);
+  if (use_dictionary) {
+    // the dictionary primes the stream's history, which is where the first, small packets of a session benefit most.
+    ZSTD_CCtx_loadDictionary(duplex->cctx, dictionary->data, dictionary->length);
+    ZSTD_DCtx_loadDictionary(duplex->dctx, dictionary->data, dictionary->length);
+  }
+  free(shipped.data);
+  array_reserve(&duplex->incoming_compressed_buffer, 4096);
+  array_reserve(&duplex->outgoing_compressed_buffer, 4096);
+  return duplex_start_sender(duplex);
+}
+
+// Hands the contents of `buffer` off to the sender thread, and leaves it empty. Only waits if the queue of the
+// packet's channel is full.
+static int send_compressed_buffer(SDuplex* duplex, EPacketType type, array_t* buffer) {
+  if (!duplex_check(duplex))
+    return -1;
+  duplex_capture(duplex, buffer->data, buffer->length);
+  trace_write(duplex->trace, TRACE_SENT, type, duplex->connection, buffer->data, buffer->length);
+  size_t length = buffer->length;
+  SChannel* channel = &duplex->channels[packet_channel(type)];
+  pthread_mutex_lock(&duplex->mutex);
+  int failed;
+  while (!(failed = __atomic_load_n(&duplex->failed, __ATOMIC_ACQUIRE)) && channel->length == SEND_QUEUE_LENGTH)
+    pthread_cond_wait(&duplex->cond, &duplex->mutex);
+  if (!failed) {
+    SPacket* packet = &channel->queue[(channel->start + channel->length) % SEND_QUEUE_LENGTH];
+    array_t empty = packet->buffer;
+    packet->type = type;
+    packet->buffer = *buffer;
+    packet->queued_at = get_time();
+    *buffer = empty;
+    ++channel->length;
+    pthread_cond_broadcast(&duplex->cond);
+  }
+  pthread_mutex_unlock(&duplex->mutex);
+  return failed ? -1 : length;
+}
+
+static int duplex_compression_level(SDuplex* duplex, EPacketType type) {
+  if (duplex->sending)
+    pthread_mutex_lock(&duplex->mutex);
+  int level = duplex->levels[type].level;
+  if (duplex->sending)
+    pthread_mutex_unlock(&duplex->mutex);
+  return level;
+}
+
+static void set_compression_level(SCompressionLevel* level, int value, int fixed) {
+  if (fixed)
+    level->level = value;
+  level->fixed = fixed;
+  level->packets = 0;
+}
+
+static void duplex_set_compression_level(SDuplex* duplex, EPacketType type, int value, int fixed) {
+  if (duplex->sending)
+    pthread_mutex_lock(&duplex->mutex);
+  set_compression_level(&duplex->levels[type], value, fixed);
+  if (duplex->sending)
+    pthread_mutex_unlock(&duplex->mutex);
+}
+
+// Reads the arguments to a compression_level method: a packet type, and optionally a level to fix it at, or `false`
+// to have it adapt again. Returns whether there's anything to set.
+static int check_compression_level(lua_State* L, EPacketType* type, int* value, int* fixed) {
+  *type = luaL_checkoption(L, 2, NULL, packet_type_names);
+  luaL_argcheck(L, *type != PACKET_NONE, 2, "not a packet type");
+  if (lua_isnone(L, 3))
+    return 0;
+  *fixed = lua_toboolean(L, 3);
+  *value = *fixed ? luaL_checkinteger(L, 3) : 0;
+  luaL_argcheck(L, !*fixed || (*value >= ZSTD_minCLevel() && *value <= ZSTD_maxCLevel()), 3, "compression level out of range");
+  return 1;
+}
+
+static void push_histogram(lua_State* L, SHistogram* histogram) {
+  lua_createtable(L, HISTOGRAM_BUCKETS, 0);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    lua_pushinteger(L, histogram->counts[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+// Pushes a table of the counters for each type of packet there's been any of, keyed by packet_type_names; times are
+// in seconds.
+static void push_packet_stats(lua_State* L, SPacketStats* stats, const char* time_name) {
+  lua_newtable(L);
+  for (int i = PACKET_NONE + 1; i < PACKET_TYPE_COUNT; ++i) {
+    if (!stats[i].packets)
+      continue;
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, stats[i].packets);
+    lua_setfield(L, -2, "packets");
+    lua_pushinteger(L, stats[i].raw_bytes);
+    lua_setfield(L, -2, "raw_bytes");
+    lua_pushinteger(L, stats[i].compressed_bytes);
+    lua_setfield(L, -2, "compressed_bytes");
+    lua_pushnumber(L, stats[i].time / 1e9);
+    lua_setfield(L, -2, time_name);
+    lua_pushnumber(L, stats[i].stall_time / 1e9);
+    lua_setfield(L, -2, "stall_time");
+    lua_setfield(L, -2, packet_type_names[i]);
+  }
+}
+
+// Sets `sent`, `received` and `send_latency` on the table on top of the stack.
+static void push_duplex_stats(lua_State* L, SDuplex* duplex) {
+  SPacketStats sent[PACKET_TYPE_COUNT];
+  SHistogram send_latency;
+  if (duplex->sending)
+    pthread_mutex_lock(&duplex->mutex);
+  memcpy(sent, duplex->sent_stats, sizeof(sent));
+  send_latency = duplex->send_latency;
+  if (duplex->sending)
+    pthread_mutex_unlock(&duplex->mutex);
+  push_packet_stats(L, sent, "compress_time");
+  lua_setfield(L, -2, "sent");
+  push_packet_stats(L, duplex->received_stats, "decompress_time");
+  lua_setfield(L, -2, "received");
+  push_histogram(L, &send_latency);
+  lua_setfield(L, -2, "send_latency");
+}
+
+static void duplex_reset_stats(SDuplex* duplex) {
+  if (duplex->sending)
+    pthread_mutex_lock(&duplex->mutex);
+  memset(duplex->sent_stats, 0, sizeof(duplex->sent_stats));
+  memset(&duplex->send_latency, 0, sizeof(duplex->send_latency));
+  if (duplex->sending)
+    pthread_mutex_unlock(&duplex->mutex);
+  memset(duplex->received_stats, 0, sizeof(duplex->received_stats));
+}
+
+// Sets the frame counters on the table on top of the stack; `time_name` is what the time spent on frames is called.
+static void push_frame_stats(lua_State* L, SFrameStats* stats, const char* time_name) {
+  lua_pushinteger(L, stats->frames);
+  lua_setfield(L, -2, "frames");
+  lua_pushinteger(L, stats->keyframes);
+  lua_setfield(L, -2, "keyframes");
+  lua_pushinteger(L, stats->commands);
+  lua_setfield(L, -2, "commands");
+  lua_pushnumber(L, stats->frames ? (lua_Number)stats->commands / stats->frames : 0);
+  lua_setfield(L, -2, "commands_per_frame");
+  lua_pushnumber(L, stats->time / 1e9);
+  lua_setfield(L, -2, time_name);
+  push_histogram(L, &stats->histogram);
+  lua_setfield(L, -2, "frame_times");
+}
+
+static void record_frame(SFrameStats* stats, size_t commands, int keyframe, uint64_t start) {
+  uint64_t duration = get_time() - start;
+  ++stats->frames;
+  stats->keyframes += keyframe != 0;
+  stats->commands += commands;
+  stats->time += duration;
+  record_duration(&stats->histogram, duration);
+}
+
+static SPacket* duplex_received_packet(SDuplex* duplex) {
+  if (duplex->received_length == duplex->received_allocated) {
+    array_reserve(&duplex->received, (duplex->received_allocated + 1) * sizeof(SPacket));
+    memset(&((SPacket*)duplex->received.data)[duplex->received_allocated++], 0, sizeof(SPacket));
+  }
+  return &((SPacket*)duplex->received.data)[duplex->received_length++];
+}
+
+// Hands out the next received packet, if the current one has been dealt with; returns whether there's a packet to deal with.
+static int duplex_next_packet(SDuplex* duplex) {
+  if (duplex->incoming_packet_type == PACKET_NONE && duplex->received_start < duplex->received_length) {
+    SPacket* packet = &((SPacket*)duplex->received.data)[duplex->received_start++];
+    array_t buffer = duplex->incoming_buffer;
+    duplex->incoming_buffer = packet->buffer;
+    duplex->incoming_packet_type = packet->type;
+    packet->buffer = buffer;
+    array_clear(&packet->buffer);
+    if (duplex->received_start == duplex->received_length)
+      duplex->received_start = duplex->received_length = 0;
+  }
+  return duplex->incoming_packet_type != PACKET_NONE;
+}
+
+static int decompress_packet(SDuplex* duplex, const char* data, size_t length, char* out, size_t out_length) {
+  ZSTD_inBuffer input = { data, length, 0 };
+  ZSTD_outBuffer output = { out, out_length, 0 };
+  while (input.pos < input.size || output.pos < output.size) {
+    size_t input_pos = input.pos, output_pos = output.pos;
+    size_t result = ZSTD_decompressStream(duplex->dctx, &output, &input);
+    if (ZSTD_isError(result) || (input.pos == input_pos && output.pos == output_pos)) {
+      fprintf(stderr, "Error: %s\n", ZSTD_isError(result) ? ZSTD_getErrorName(result) : "truncated packet");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Reads whatever has arrived, and queues up every complete packet in it.
+// Closes the connection over something received that the other end can't have sent, dropping whatever's half received.
+static int reject_incoming(SDuplex* duplex) {
+  duplex_close(duplex);
+  duplex->received_start = duplex->received_length = 0;
+  for (int i = 0; i < CHANNEL_COUNT; ++i)
+    array_clear(&duplex->partial[i]);
+  return 0;
+}
+
+static int recv_compressed_buffer(SDuplex* duplex) {
+  if (!duplex_check(duplex))
+    return -1;
+  if (duplex_next_packet(duplex))
+    return 1;
+  array_t* incoming = &duplex->incoming_compressed_buffer;
+  // only a partial packet can be left over; it's moved to the front once there's no room left to read in behind it.
+  if (duplex->incoming_offset == incoming->length) {
+    duplex->incoming_offset = 0;
+    incoming->length = 0;
+  } else if (duplex->incoming_offset > 0 && incoming->length == incoming->capacity) {
+    memmove(incoming->data, &incoming->data[duplex->incoming_offset], incoming->length - duplex->incoming_offset);
+    incoming->length -= duplex->incoming_offset;
+    duplex->incoming_offset = 0;
+  }
+  int length = duplex->transport->read(duplex, &incoming->data[incoming->length], incoming->capacity - incoming->length);
+  // there's always room to read into, so nothing read means the other end has closed the connection.
+  if (length == 0 || (length < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+    duplex_close(duplex);
+    return 0;
+  }
+  if (length > 0)
+    incoming->length += length;
+  while (incoming->length - duplex->incoming_offset >= PACKET_HEADER_SIZE) {
+    const char* header = &incoming->data[duplex->incoming_offset];
+    int header_compressed_length = *((int*)&header[sizeof(char)]), header_raw_length = *((int*)&header[sizeof(char) + sizeof(int)]);
+    // both come from the other end, and so are checked before anything's sized by them.
+    if (header_compressed_length < 0 || header_compressed_length > MAX_COMPRESSED_CHUNK_SIZE || header_raw_length < 0 || header_raw_length > MAX_CHUNK_SIZE)
+      return reject_incoming(duplex);
+    size_t total_packet_length = header_compressed_length + PACKET_HEADER_SIZE;
+    if (incoming->length - duplex->incoming_offset < total_packet_length) {
+      // make sure the rest of the packet fits, once it's been moved to the front.
+      array_reserve(incoming, total_packet_length);
+      break;
+    }
+    // chunks are put together in the channel's partial buffer, and the packet's only handed out once the last is in.
+    EPacketType type = (uint8_t)*header & ~CHUNK_CONTINUED;
+    int more = ((uint8_t)*header & CHUNK_CONTINUED) != 0;
+    size_t compressed_length = header_compressed_length, raw_length = header_raw_length;
+    uint64_t start = get_time();
+    int invalid = type <= PACKET_NONE || type >= PACKET_TYPE_COUNT;
+    EChannel channel = invalid ? CHANNEL_FRAMES : packet_channel(type);
+    array_t* partial = &duplex->partial[channel];
+    invalid = invalid || (partial->length && duplex->partial_type[channel] != type) || partial->length + raw_length > MAX_PACKET_SIZE;
+    if (!invalid) {
+      array_reserve(partial, partial->length + raw_length);
+      if (duplex->transport->compressed)
+        invalid = decompress_packet(duplex, &header[PACKET_HEADER_SIZE], compressed_length, &partial->data[partial->length], raw_length);
+      else {
+        invalid = raw_length != compressed_length;
+        if (!invalid)
+          memcpy(&partial->data[partial->length], &header[PACKET_HEADER_SIZE], raw_length);
+      }
+    }
+    if (invalid)
+      return reject_incoming(duplex);
+    partial->length += raw_length;
+    duplex->partial_type[channel] = type;
+    SPacketStats* stats = &duplex->received_stats[type];
+    stats->raw_bytes += raw_length;
+    stats->compressed_bytes += total_packet_length;
+    stats->time += get_time() - start;
+    duplex->incoming_offset += total_packet_length;
+    if (more)
+      continue;
+    SPacket* packet = duplex_received_packet(duplex);
+    array_t buffer = packet->buffer;
+    packet->type = type;
+    packet->buffer = *partial;
+    *partial = buffer;
+    array_clear(partial);
+    ++stats->packets;
+    duplex_capture(duplex, packet->buffer.data, packet->buffer.length);
+    trace_write(duplex->trace, TRACE_RECEIVED, packet->type, duplex->connection, packet->buffer.data, packet->buffer.length);
+  }
+  duplex_next_packet(duplex);
+  return 1;
+}
+
+#define LUA_TINTEGER 200
+static void push_lua(lua_State* L, int n, array_t* buffer) {
+  array_append(buffer, &n, sizeof(n));
+  for (int i = -n; i < 0; ++i) {
+    int type = lua_type(L, i);
+    if (type == LUA_TNUMBER && lua_isinteger(L, i))
+      type = LUA_TINTEGER;
+    array_append(buffer, &type, sizeof(type));
+    switch (type) {
+      case LUA_TNIL: break;
+      case LUA_TSTRING: {
+        size_t len;
+        const char* str = lua_tolstring(L, i, &len);
+        array_append(buffer, &len, sizeof(len));
+        array_append(buffer, str, len);
+      } break;
+      case LUA_TINTEGER: {
+        int n = lua_tointeger(L, i);
+        array_append(buffer, &n, sizeof(n));
+      } break;
+      case LUA_TNUMBER: {
+        double n = lua_tonumber(L, i);
+        array_append(buffer, &n, sizeof(n));
+      } break;
+      case LUA_TBOOLEAN: {
+        char c = lua_toboolean(L, i);
+        array_append(buffer, &c, sizeof(c));
+      } break;
+    }
+  }
+  lua_pop(L, n);
+}
+
+static int pull_lua(lua_State* L, array_t* buffer) {
+  int arg_count = 0;
+  
+  const char* cmd_ptr = buffer->data;
+  const char* end = buffer->data + buffer->length;
+  
+  if (cmd_ptr < end) {
+    arg_count = *((int*)cmd_ptr);
+    cmd_ptr += sizeof(int);
+    for (int i = 0; i < arg_count; ++i) {
+      int type = *((int*)cmd_ptr);
+      cmd_ptr += sizeof(int);
+      switch (type) {
+        case LUA_TNIL:
+          lua_pushnil(L);
+        break;
+        case LUA_TINTEGER:
+          lua_pushinteger(L, *(int*)cmd_ptr);
+          cmd_ptr += sizeof(int);
+        break;
+        case LUA_TBOOLEAN:
+          lua_pushboolean(L, *cmd_ptr);
+          ++cmd_ptr;
+        break;
+        case LUA_TSTRING: {
+          size_t length = *(size_t*)cmd_ptr;
+          cmd_ptr += sizeof(size_t);
+          lua_pushlstring(L, cmd_ptr, length);
+          cmd_ptr += length;
+        } break;
+        case LUA_TNUMBER:
+          lua_pushnumber(L, *(double*)cmd_ptr);
+          cmd_ptr += sizeof(double);
+        break;
+      }
+    }
+  }
+  return arg_count;
+}
+
+static void write_varint(array_t* buffer, uint64_t value) {
+  uint8_t bytes[10];
+  int length = 0;
+  while (value >= 0x80) {
+    bytes[length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  bytes[length++] = value;
+  array_append(buffer, bytes, length);
+}
+
+static int read_varint(const char** ptr, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; *ptr < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*ptr)++;
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 1;
+  }
+  return 0;
+}
+
+static uint64_t zigzag_encode(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+static int64_t zigzag_decode(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+// Events the client sends go out in one batch per poll; each is a varint argument count, followed by its tagged values.
+// The names of the usual events are sent as an index into this list. The batch ends with a byte of BATCH_ flags.
+static const char* event_names[] = { "quit", "resized", "exposed", "minimized", "maximized", "restored", "focuslost", "filedropped",
+  "keypressed", "keyreleased", "textinput", "textediting", "mousepressed", "mousereleased", "mousemoved", "mousewheel",
+  "touchpressed", "touchreleased", "touchmoved", NULL };
+enum { VALUE_NIL, VALUE_FALSE, VALUE_TRUE, VALUE_INTEGER, VALUE_FLOAT, VALUE_NUMBER, VALUE_STRING, VALUE_EVENT_NAME };
+
+static int find_event_name(const char* name) {
+  for (int i = 0; name && event_names[i]; ++i) {
+    if (strcmp(event_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void write_event_number(array_t* buffer, lua_Number value, int integer) {
+  uint8_t tag;
+  if (integer) {
+    tag = VALUE_INTEGER;
+    array_append(buffer, &tag, 1);
+    write_varint(buffer, zigzag_encode((int64_t)value));
+  } else if ((lua_Number)(float)value == value) {
+    float single = value;
+    tag = VALUE_FLOAT;
+    array_append(buffer, &tag, 1);
+    array_append(buffer, &single, sizeof(single));
+  } else {
+    double number = value;
+    tag = VALUE_NUMBER;
+    array_append(buffer, &tag, 1);
+    array_append(buffer, &number, sizeof(number));
+  }
+}
+
+static void write_event(lua_State* L, int start, int count, array_t* buffer) {
+  write_varint(buffer, count);
+  for (int i = start; i < start + count; ++i) {
+    uint8_t tag;
+    switch (lua_type(L, i)) {
+      case LUA_TBOOLEAN:
+        tag = lua_toboolean(L, i) ? VALUE_TRUE : VALUE_FALSE;
+        array_append(buffer, &tag, 1);
+      break;
+      case LUA_TNUMBER:
+        write_event_number(buffer, lua_tonumber(L, i), lua_isinteger(L, i));
+      break;
+      case LUA_TSTRING: {
+        size_t length;
+        const char* str = lua_tolstring(L, i, &length);
+        int name = i == start ? find_event_name(str) : -1;
+        if (name != -1) {
+          tag = VALUE_EVENT_NAME;
+          array_append(buffer, &tag, 1);
+          write_varint(buffer, name);
+        } else {
+          tag = VALUE_STRING;
+          array_append(buffer, &tag, 1);
+          write_varint(buffer, length);
+          array_append(buffer, str, length);
+        }
+      } break;
+      default:
+        tag = VALUE_NIL;
+        array_append(buffer, &tag, 1);
+      break;
+    }
+  }
+}
+
+static void write_coalesced_event(SCoalescedEvent* event, array_t* buffer) {
+  uint8_t tag = VALUE_EVENT_NAME;
+  write_varint(buffer, event->count + 1);
+  array_append(buffer, &tag, 1);
+  write_varint(buffer, event->name);
+  for (int i = 0; i < event->count; ++i)
+    write_event_number(buffer, event->values[i], event->integer[i]);
+}
+
+// Pushes the next event in the batch onto the stack, and returns its argument count, or -1 if it's malformed.
+static int read_event(lua_State* L, const char** ptr, const char* end) {
+  uint64_t count, value;
+  if (!read_varint(ptr, end, &count) || count > (uint64_t)(end - *ptr) || !lua_checkstack(L, count))
+    return -1;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (*ptr >= end)
+      return -1;
+    switch (*(*ptr)++) {
+      case VALUE_NIL: lua_pushnil(L); break;
+      case VALUE_FALSE: lua_pushboolean(L, 0); break;
+      case VALUE_TRUE: lua_pushboolean(L, 1); break;
+      case VALUE_INTEGER:
+        if (!read_varint(ptr, end, &value))
+          return -1;
+        lua_pushinteger(L, zigzag_decode(value));
+      break;
+      case VALUE_FLOAT: {
+        float single;
+        if (end - *ptr < sizeof(single))
+          return -1;
+        memcpy(&single, *ptr, sizeof(single));
+        *ptr += sizeof(single);
+        lua_pushnumber(L, single);
+      } break;
+      case VALUE_NUMBER: {
+        double number;
+        if (end - *ptr < sizeof(number))
+          return -1;
+        memcpy(&number, *ptr, sizeof(number));
+        *ptr += sizeof(number);
+        lua_pushnumber(L, number);
+      } break;
+      case VALUE_STRING:
+        if (!read_varint(ptr, end, &value) || value > (uint64_t)(end - *ptr))
+          return -1;
+        lua_pushlstring(L, *ptr, value);
+        *ptr += value;
+      break;
+      case VALUE_EVENT_NAME:
+        if (!read_varint(ptr, end, &value) || value >= sizeof(event_names) / sizeof(event_names[0]) - 1)
+          return -1;
+        lua_pushstring(L, event_names[value]);
+      break;
+      default:
+        return -1;
+    }
+  }
+  return count;
+}
+
+static void rencache_clear(SRencache* rencache) {
+  array_clear(&rencache->buffer);
+  array_clear(&rencache->commands);
+  array_clear(&rencache->regions);
+  rencache->checksum = HASH_INITIAL;
+}
+
+static void rencache_free(SRencache* rencache) {
+  free(rencache->buffer.data);
+  free(rencache->commands.data);
+  free(rencache->regions.data);
+}
+
+static void rencache_swap(SRencache* a, SRencache* b) {
+  SRencache tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static size_t rencache_length(SRencache* rencache) {
+  return rencache->commands.length / sizeof(SCommandEntry);
+}
+
+static Command* rencache_command(SRencache* rencache, size_t i) {
+  return (Command*)&rencache->buffer.data[((SCommandEntry*)rencache->commands.data)[i].offset];
+}
+
+// Byte offset of the end of the first `i` commands.
+static size_t rencache_offset(SRencache* rencache, size_t i) {
+  return i < rencache_length(rencache) ? ((SCommandEntry*)rencache->commands.data)[i].offset : rencache->buffer.length;
+}
+
+// Makes room for a `size` byte command at the end of the frame, and returns it zeroed, so that padding hashes the same
+// every frame. It's filled in right there, and then added with commit_command. The frame's buffer keeps its capacity
+// from one frame to the next, and the server's two frames take turns, so once they've grown to fit, recording a command
+// is just writing it.
+static Command* reserve_command(SRencache* rencache, enum CommandType type, size_t size) {
+  array_reserve(&rencache->buffer, rencache->buffer.length + size);
+  Command* command = memset(&rencache->buffer.data[rencache->buffer.length], 0, size);
+  command->type = type;
+  command->size = size;
+  return command;
+}
+
+static int commit_command(SRencache* rencache) {
+  Command* command = (Command*)&rencache->buffer.data[rencache->buffer.length];
+  array_reserve(&rencache->commands, rencache->commands.length + sizeof(SCommandEntry));
+  SCommandEntry* entry = (SCommandEntry*)&rencache->commands.data[rencache->commands.length];
+  *entry = (SCommandEntry){ rencache->buffer.length, hash_bytes(command, command->size) };
+  rencache->commands.length += sizeof(SCommandEntry);
+  rencache->buffer.length += command->size;
+  // one step of hash() per command, rather than one per byte of its hash.
+  rencache->checksum = (rencache->checksum ^ entry->hash) * 16777619;
+  return command->size;
+}
+
+static int push_command(SRencache* rencache, Command* command) {
+  memcpy(reserve_command(rencache, command->type, command->size), command, command->size);
+  return commit_command(rencache);
+}
+
+// Rebuilds the command index of a buffer received over the wire; returns -1 if the buffer is malformed.
+static int index_commands(SRencache* rencache) {
+  array_clear(&rencache->commands);
+  size_t offset = 0;
+  while (offset < rencache->buffer.length) {
+    Command* command = (Command*)&rencache->buffer.data[offset];
+    if (rencache->buffer.length - offset < sizeof(Command) || command->size < sizeof(Command) || command->size > rencache->buffer.length - offset)
+      return -1;
+    SCommandEntry entry = { offset, 0 };
+    array_append(&rencache->commands, &entry, sizeof(entry));
+    offset += command->size;
+  }
+  return 0;
+}
+
+static int commands_equal(SRencache* a, size_t i, SRencache* b, size_t j) {
+  if (((SCommandEntry*)a->commands.data)[i].hash != ((SCommandEntry*)b->commands.data)[j].hash)
+    return 0;
+  Command* ca = rencache_command(a, i);
+  Command* cb = rencache_command(b, j);
+  return ca->size == cb->size && memcmp(ca, cb, ca->size) == 0;
+}
+
+// The y of whatever a command draws, which is what scrolling changes; NULL for commands that stay put.
+static int* command_y(Command* command) {
+  switch (command->type) {
+    case DRAW_TEXT: return &((DrawTextCommand*)command)->y;
+    case DRAW_RECT: return &((DrawRectCommand*)command)->rect.y;
+    default: return NULL;
+  }
+}
+
+// Copies `command` into `scratch`, moved down by `dy`, and returns the copy.
+static Command* shift_command(array_t* scratch, Command* command, int dy) {
+  array_reserve(scratch, command->size);
+  Command* shifted = memcpy(scratch->data, command, command->size);
+  int* y = command_y(shifted);
+  if (y)
+    *y += dy;
+  return shifted;
+}
+
+static unsigned int shifted_hash(array_t* scratch, Command* command, int dy) {
+  return hash_bytes(shift_command(scratch, command, dy), command->size);
+}
+
+// Whether a's i'th command is b's j'th, moved down by `dy`.
+static int commands_equal_shifted(SRencache* a, size_t i, SRencache* b, size_t j, int dy, array_t* scratch) {
+  if (!dy)
+    return commands_equal(a, i, b, j);
+  Command* ca = rencache_command(a, i);
+  Command* cb = rencache_command(b, j);
+  return ca->size == cb->size && memcmp(ca, shift_command(scratch, cb, dy), ca->size) == 0;
+}
+
+static SStringEntry* string_entry(SStringTable* strings, uint32_t link) {
+  return &((SStringEntry*)strings->entries.data)[link - 1];
+}
+
+static void string_table_init(SStringTable* strings, size_t max_memory) {
+  memset(strings, 0, sizeof(SStringTable));
+  strings->max_memory = max_memory;
+  if (max_memory) {
+    size_t buckets = 256;
+    while (buckets < max_memory / 64)
+      buckets <<= 1;
+    array_reserve(&strings->buckets, buckets * sizeof(uint32_t));
+    strings->buckets.length = buckets * sizeof(uint32_t);
+    memset(strings->buckets.data, 0, strings->buckets.length);
+  }
+}
+
+static void string_table_free(SStringTable* strings) {
+  for (size_t i = 0; i < strings->entries.length / sizeof(SStringEntry); ++i)
+    free(((SStringEntry*)strings->entries.data)[i].text);
+  free(strings->entries.data);
+  free(strings->buckets.data);
+  memset(strings, 0, sizeof(SStringTable));
+}
+
+static uint32_t* string_bucket(SStringTable* strings, unsigned int hash) {
+  return &((uint32_t*)strings->buckets.data)[hash & (strings->buckets.length / sizeof(uint32_t) - 1)];
+}
+
+static void string_table_unlink(SStringTable* strings, uint32_t link) {
+  SStringEntry* entry = string_entry(strings, link);
+  if (entry->older) string_entry(strings, entry->older)->newer = entry->newer; else strings->oldest = entry->newer;
+  if (entry->newer) string_entry(strings, entry->newer)->older = entry->older; else strings->newest = entry->older;
+  entry->older = entry->newer = 0;
+}
+
+static void string_table_link_newest(SStringTable* strings, uint32_t link) {
+  SStringEntry* entry = string_entry(strings, link);
+  entry->older = strings->newest;
+  if (strings->newest) string_entry(strings, strings->newest)->newer = link; else strings->oldest = link;
+  strings->newest = link;
+}
+
+static void string_table_touch(SStringTable* strings, uint32_t link) {
+  if (strings->newest == link)
+    return;
+  string_table_unlink(strings, link);
+  string_table_link_newest(strings, link);
+}
+
+static void string_table_evict(SStringTable* strings, uint32_t link) {
+  SStringEntry* entry = string_entry(strings, link);
+  string_table_unlink(strings, link);
+  uint32_t* next = string_bucket(strings, entry->hash);
+  while (*next != link)
+    next = &string_entry(strings, *next)->next;
+  *next = entry->next;
+  strings->memory -= entry->len + sizeof(SStringEntry);
+  free(entry->text);
+  entry->text = NULL;
+  entry->next = strings->free;
+  strings->free = link;
+}
+
+// Returns the link of the entry holding `text`, or 0.
+static uint32_t string_table_find(SStringTable* strings, const char* text, size_t len, unsigned int hash) {
+  for (uint32_t link = *string_bucket(strings, hash); link; link = string_entry(strings, link)->next) {
+    SStringEntry* entry = string_entry(strings, link);
+    if (entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0)
+      return link;
+  }
+  return 0;
+}
+
+// Evicts the least recently used entries until `text` fits, then adds it as the most recently used.
+static void string_table_insert(SStringTable* strings, const char* text, size_t len, unsigned int hash) {
+  size_t cost = len + sizeof(SStringEntry);
+  if (cost > strings->max_memory)
+    return;
+  while (strings->memory + cost > strings->max_memory)
+    string_table_evict(strings, strings->oldest);
+  uint32_t link = strings->free;
+  if (link) {
+    strings->free = string_entry(strings, link)->next;
+  } else {
+    SStringEntry entry = {0};
+    array_append(&strings->entries, &entry, sizeof(SStringEntry));
+    link = strings->entries.length / sizeof(SStringEntry);
+  }
+  SStringEntry* entry = string_entry(strings, link);
+  *entry = (SStringEntry){ malloc(len), len, hash, *string_bucket(strings, hash), 0, 0 };
+  memcpy(entry->text, text, len);
+  *string_bucket(strings, hash) = link;
+  strings->memory += cost;
+  string_table_link_newest(strings, link);
+}
+
+static int is_interned(SStringTable* strings, Command* command) {
+  return strings->max_memory && command->type == DRAW_TEXT && ((DrawTextCommand*)command)->len >= MIN_INTERNED_LENGTH;
+}
+
+// Writes out the palette and string table as they stand, for a viewer that's catching up to take over: every entry
+// under the link it has, from the least to the most recently used, and the free list, so that both ends carry on
+// inserting and evicting alike.
+static void write_shared_state(SCommandCodec* codec, SStringTable* strings, array_t* out) {
+  uint32_t values[3] = { strings->max_memory, strings->entries.length / sizeof(SStringEntry), 0 };
+  for (uint32_t link = strings->free; link; link = string_entry(strings, link)->next)
+    ++values[2];
+  array_append(out, codec->palette, sizeof(codec->palette));
+  array_append(out, values, sizeof(values));
+  for (uint32_t link = strings->free; link; link = string_entry(strings, link)->next)
+    array_append(out, &link, sizeof(link));
+  for (uint32_t link = strings->oldest; link; link = string_entry(strings, link)->newer) {
+    uint32_t len = string_entry(strings, link)->len;
+    array_append(out, &link, sizeof(link));
+    array_append(out, &len, sizeof(len));
+    array_append(out, string_entry(strings, link)->text, len);
+  }
+}
+
+// Takes over what write_shared_state wrote; returns -1 if it doesn't make up a consistent table.
+static int read_shared_state(SCommandCodec* codec, SStringTable* strings, const char* data, size_t length) {
+  const char* end = data + length;
+  uint32_t values[3], link, len;
+  if (length < sizeof(codec->palette) + sizeof(values))
+    return -1;
+  memcpy(codec->palette, data, sizeof(codec->palette));
+  memcpy(values, data + sizeof(codec->palette), sizeof(values));
+  data += sizeof(codec->palette) + sizeof(values);
+  uint32_t count = values[1], free_count = values[2], used_count = 0;
+  if (count > values[0] / sizeof(SStringEntry) || free_count > count || (size_t)(end - data) / sizeof(uint32_t) < free_count)
+    return -1;
+  string_table_free(strings);
+  string_table_init(strings, values[0]);
+  array_reserve(&strings->entries, count * sizeof(SStringEntry));
+  memset(strings->entries.data, 0, count * sizeof(SStringEntry));
+  strings->entries.length = count * sizeof(SStringEntry);
+  // every link has to be either free or in use, and only once.
+  char* taken = calloc(count + 1, 1);
+  uint32_t* previous = &strings->free;
+  for (uint32_t i = 0; i < free_count; ++i, data += sizeof(link)) {
+    memcpy(&link, data, sizeof(link));
+    if (!link || link > count || taken[link])
+      goto invalid;
+    taken[link] = 1;
+    *previous = link;
+    previous = &string_entry(strings, link)->next;
+  }
+  while (data < end) {
+    if ((size_t)(end - data) < sizeof(link) + sizeof(len))
+      goto invalid;
+    memcpy(&link, data, sizeof(link));
+    memcpy(&len, data + sizeof(link), sizeof(len));
+    data += sizeof(link) + sizeof(len);
+    if (!link || link > count || taken[link] || !len || len > (size_t)(end - data) || strings->memory + len + sizeof(SStringEntry) > strings->max_memory)
+      goto invalid;
+    taken[link] = 1;
+    ++used_count;
+    unsigned int hash = hash_bytes(data, len);
+    SStringEntry* entry = string_entry(strings, link);
+    *entry = (SStringEntry){ malloc(len), len, hash, *string_bucket(strings, hash), 0, 0 };
+    memcpy(entry->text, data, len);
+    *string_bucket(strings, hash) = link;
+    strings->memory += len + sizeof(SStringEntry);
+    string_table_link_newest(strings, link);
+    data += len;
+  }
+  if (used_count + free_count != count)
+    goto invalid;
+  free(taken);
+  return 0;
+invalid:
+  free(taken);
+  return -1;
+}
+
+static void codec_reset_frame(SCommandCodec* codec) {
+  codec->rect = (RenRect){ 0, 0, 0, 0 };
+  codec->text_x = codec->text_y = 0;
+  memset(codec->fonts, 0, sizeof(codec->fonts));
+  codec->tab_size = 0;
+}
+
+// Points every stream at `out`, or at the codec's scratch streams if columnar; end_commands puts those together.
+static void begin_commands(SCommandCodec* codec, array_t* out, array_t** streams) {
+  codec_reset_frame(codec);
+  for (int i = 0; i < STREAM_COUNT; ++i) {
+    streams[i] = codec->columnar ? &codec->streams[i] : out;
+    array_clear(&codec->streams[i]);
+  }
+}
+static void end_commands(SCommandCodec* codec, array_t* out) {
+  if (codec->columnar) {
+    for (int i = 0; i < STREAM_COUNT - 1; ++i)
+      write_varint(out, codec->streams[i].length);
+    for (int i = 0; i < STREAM_COUNT; ++i)
+      array_append(out, codec->streams[i].data, codec->streams[i].length);
+  }
+}
+static int begin_reading_commands(SCommandCodec* codec, SCommandReader* reader, const char* data, size_t length, int columnar) {
+  const char* end = data + length;
+  codec_reset_frame(codec);
+  reader->columnar = columnar;
+  if (columnar) {
+    uint64_t lengths[STREAM_COUNT - 1];
+    for (int i = 0; i < STREAM_COUNT - 1; ++i) {
+      if (!read_varint(&data, end, &lengths[i]))
+        return -1;
+    }
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+      uint64_t stream_length = i < STREAM_COUNT - 1 ? lengths[i] : (uint64_t)(end - data);
+      if (stream_length > (uint64_t)(end - data))
+        return -1;
+      reader->ptr[i] = data;
+      reader->end[i] = data + stream_length;
+      data += stream_length;
+    }
+  } else {
+    reader->ptr[0] = data;
+    reader->end[0] = end;
+  }
+  return 0;
+}
+static int commands_remaining(SCommandReader* reader) {
+  return reader->ptr[STREAM_OPS] < reader->end[STREAM_OPS];
+}
+static int read_stream_varint(SCommandReader* reader, int stream, uint64_t* value) {
+  stream = reader->columnar ? stream : 0;
+  return read_varint(&reader->ptr[stream], reader->end[stream], value) ? 0 : -1;
+}
+static int read_stream_delta(SCommandReader* reader, int stream, int* value) {
+  uint64_t delta;
+  if (read_stream_varint(reader, stream, &delta))
+    return -1;
+  *value += (int)zigzag_decode(delta);
+  return 0;
+}
+static const char* read_stream_bytes(SCommandReader* reader, int stream, size_t length) {
+  stream = reader->columnar ? stream : 0;
+  if ((size_t)(reader->end[stream] - reader->ptr[stream]) < length)
+    return NULL;
+  const char* data = reader->ptr[stream];
+  reader->ptr[stream] += length;
+  return data;
+}
+
+static void write_delta_varint(array_t* stream, int value, int previous) {
+  write_varint(stream, zigzag_encode((int64_t)value - previous));
+}
+static void write_rect(SCommandCodec* codec, RenRect rect, array_t** streams) {
+  write_delta_varint(streams[STREAM_COORDS], rect.x, codec->rect.x);
+  write_delta_varint(streams[STREAM_COORDS], rect.y, codec->rect.y);
+  write_delta_varint(streams[STREAM_COORDS], rect.width, codec->rect.width);
+  write_delta_varint(streams[STREAM_COORDS], rect.height, codec->rect.height);
+  codec->rect = rect;
+}
+static int read_rect(SCommandCodec* codec, SCommandReader* reader, RenRect* rect) {
+  if (read_stream_delta(reader, STREAM_COORDS, &codec->rect.x) || read_stream_delta(reader, STREAM_COORDS, &codec->rect.y) ||
+    read_stream_delta(reader, STREAM_COORDS, &codec->rect.width) || read_stream_delta(reader, STREAM_COORDS, &codec->rect.height))
+    return -1;
+  *rect = codec->rect;
+  return 0;
+}
+
+static uint8_t palette_slot(RenColor color) {
+  unsigned int h = HASH_INITIAL;
+  hash(&h, &color, sizeof(color));
+  return h % PALETTE_SIZE;
+}
+static int palette_has(SCommandCodec* codec, RenColor color) {
+  return memcmp(&codec->palette[palette_slot(color)], &color, sizeof(RenColor)) == 0;
+}
+static void write_color(SCommandCodec* codec, RenColor color, uint8_t op, array_t** streams) {
+  uint8_t slot = palette_slot(color);
+  if (op & OP_PALETTE_COLOR)
+    array_append(streams[STREAM_COLORS], &slot, sizeof(slot));
+  else {
+    codec->palette[slot] = color;
+    array_append(streams[STREAM_COLORS], &color, sizeof(color));
+  }
+}
+static int read_color(SCommandCodec* codec, SCommandReader* reader, uint8_t op, RenColor* color) {
+  if (op & OP_PALETTE_COLOR) {
+    const char* slot = read_stream_bytes(reader, STREAM_COLORS, sizeof(uint8_t));
+    if (!slot)
+      return -1;
+    *color = codec->palette[*(uint8_t*)slot];
+  } else {
+    const char* literal = read_stream_bytes(reader, STREAM_COLORS, sizeof(RenColor));
+    if (!literal)
+      return -1;
+    memcpy(color, literal, sizeof(RenColor));
+    codec->palette[palette_slot(*color)] = *color;
+  }
+  return 0;
+}
+
+// Writes a command out for the wire, replacing text the other end already has by its id.
+static void encode_command(SCommandCodec* codec, SStringTable* strings, Command* command, array_t** streams) {
+  uint8_t op = command->type;
+  switch (command->type) {
+    case SET_CLIP:
+      array_append(streams[STREAM_OPS], &op, sizeof(op));
+      write_rect(codec, ((SetClipCommand*)command)->rect, streams);
+    break;
+    case DRAW_RECT: {
+      DrawRectCommand* rect = (DrawRectCommand*)command;
+      op |= palette_has(codec, rect->color) ? OP_PALETTE_COLOR : 0;
+      array_append(streams[STREAM_OPS], &op, sizeof(op));
+      write_rect(codec, rect->rect, streams);
+      write_color(codec, rect->color, op, streams);
+    } break;
+    case DRAW_TEXT: {
+      DrawTextCommand* text = (DrawTextCommand*)command;
+      uint32_t link = 0;
+      if (is_interned(strings, command)) {
+        unsigned int h = hash_bytes(text->text, text->len);
+        link = string_table_find(strings, text->text, text->len, h);
+        if (link)
+          string_table_touch(strings, link);
+        else
+          string_table_insert(strings, text->text, text->len, h);
+      }
+      int integral_x = text->text_x >= -(1 << 24) && text->text_x <= (1 << 24) && text->text_x == (int)text->text_x;
+      op = link ? DRAW_TEXT_REF : DRAW_TEXT;
+      op |= palette_has(codec, text->color) ? OP_PALETTE_COLOR : 0;
+      op |= memcmp(text->fonts, codec->fonts, sizeof(codec->fonts)) == 0 ? OP_SAME_FONTS : 0;
+      op |= text->tab_size == codec->tab_size ? OP_SAME_TAB_SIZE : 0;
+      op |= integral_x ? OP_INTEGRAL_X : 0;
+      array_append(streams[STREAM_OPS], &op, sizeof(op));
+      write_color(codec, text->color, op, streams);
+      if (!(op & OP_SAME_FONTS)) {
+        int count = FONT_FALLBACK_MAX;
+        while (count > 0 && !text->fonts[count - 1])
+          --count;
+        write_varint(streams[STREAM_OPS], count);
+        for (int i = 0; i < count; ++i)
+          write_varint(streams[STREAM_OPS], zigzag_encode(text->fonts[i]));
+        memcpy(codec->fonts, text->fonts, sizeof(codec->fonts));
+      }
+      if (!(op & OP_SAME_TAB_SIZE)) {
+        array_append(streams[STREAM_OPS], &text->tab_size, sizeof(text->tab_size));
+        codec->tab_size = text->tab_size;
+      }
+      if (integral_x)
+        write_delta_varint(streams[STREAM_COORDS], text->text_x, codec->text_x);
+      else
+        array_append(streams[STREAM_COORDS], &text->text_x, sizeof(text->text_x));
+      codec->text_x = text->text_x;
+      write_delta_varint(streams[STREAM_COORDS], text->y, codec->text_y);
+      codec->text_y = text->y;
+      if (link)
+        write_varint(streams[STREAM_TEXT], link - 1);
+      else {
+        write_varint(streams[STREAM_TEXT], text->len);
+        array_append(streams[STREAM_TEXT], text->text, text->len);
+      }
+    } break;
+    default: break;
+  }
+}
+static int decode_command(SCommandCodec* codec, SStringTable* strings, SCommandReader* reader, array_t* out) {
+  const char* op_ptr = read_stream_bytes(reader, STREAM_OPS, sizeof(uint8_t));
+  if (!op_ptr)
+    return -1;
+  uint8_t op = *op_ptr;
+  switch (op & OP_TYPE_MASK) {
+    case SET_CLIP: {
+      SetClipCommand clip = { { SET_CLIP, sizeof(SetClipCommand) } };
+      if (read_rect(codec, reader, &clip.rect))
+        return -1;
+      array_append(out, &clip, sizeof(clip));
+    } break;
+    case DRAW_RECT: {
+      DrawRectCommand rect = { { DRAW_RECT, sizeof(DrawRectCommand) } };
+      if (read_rect(codec, reader, &rect.rect) || read_color(codec, reader, op, &rect.color))
+        return -1;
+      array_append(out, &rect, sizeof(rect));
+    } break;
+    case DRAW_TEXT:
+    case DRAW_TEXT_REF: {
+      DrawTextCommand header;
+      uint64_t value;
+      memset(&header, 0, sizeof(header));
+      if (read_color(codec, reader, op, &header.color))
+        return -1;
+      if (!(op & OP_SAME_FONTS)) {
+        if (read_stream_varint(reader, STREAM_OPS, &value) || value > FONT_FALLBACK_MAX)
+          return -1;
+        memset(codec->fonts, 0, sizeof(codec->fonts));
+        for (uint64_t i = 0; i < value; ++i) {
+          uint64_t font;
+          if (read_stream_varint(reader, STREAM_OPS, &font))
+            return -1;
+          codec->fonts[i] = zigzag_decode(font);
+        }
+      }
+      if (!(op & OP_SAME_TAB_SIZE)) {
+        const char* tab_size = read_stream_bytes(reader, STREAM_OPS, sizeof(int8_t));
+        if (!tab_size)
+          return -1;
+        codec->tab_size = *tab_size;
+      }
+      if (op & OP_INTEGRAL_X) {
+        if (read_stream_delta(reader, STREAM_COORDS, &codec->text_x))
+          return -1;
+        header.text_x = codec->text_x;
+      } else {
+        const char* text_x = read_stream_bytes(reader, STREAM_COORDS, sizeof(float));
+        if (!text_x)
+          return -1;
+        memcpy(&header.text_x, text_x, sizeof(float));
+        codec->text_x = header.text_x;
+      }
+      if (read_stream_delta(reader, STREAM_COORDS, &codec->text_y))
+        return -1;
+      header.y = codec->text_y;
+      memcpy(header.fonts, codec->fonts, sizeof(codec->fonts));
+      header.tab_size = codec->tab_size;
+      const char* text;
+      if (read_stream_varint(reader, STREAM_TEXT, &value))
+        return -1;
+      if ((op & OP_TYPE_MASK) == DRAW_TEXT_REF) {
+        uint32_t link = value + 1;
+        if (!strings->max_memory || value >= strings->entries.length / sizeof(SStringEntry) || !string_entry(strings, link)->text)
+          return -1;
+        string_table_touch(strings, link);
+        text = string_entry(strings, link)->text;
+        header.len = string_entry(strings, link)->len;
+      } else {
+        if (!(text = read_stream_bytes(reader, STREAM_TEXT, value)))
+          return -1;
+        header.len = value;
+      }
+      header.command = (Command){ DRAW_TEXT, sizeof(DrawTextCommand) + header.len };
+      if ((op & OP_TYPE_MASK) == DRAW_TEXT && is_interned(strings, &header.command))
+        string_table_insert(strings, text, header.len, hash_bytes(text, header.len));
+      size_t offset = out->length;
+      array_reserve(out, offset + header.command.size);
+      memset(&out->data[offset], 0, header.command.size);
+      memcpy(&out->data[offset], &header, sizeof(header));
+      memcpy(((DrawTextCommand*)&out->data[offset])->text, text, header.len);
+      out->length += header.command.size;
+    } break;
+  }
+  return 0;
+}
+static void encode_commands(SCommandCodec* codec, SStringTable* strings, SRencache* rencache, size_t start, size_t count, array_t** streams) {
+  for (size_t i = start; i < start + count; ++i)
+    encode_command(codec, strings, rencache_command(rencache, i), streams);
+}
+
+static void append_delta_op(array_t* ops, SDeltaOp* op, size_t insert_start) {
+  SPendingDeltaOp pending = { *op, insert_start };
+  array_append(ops, &pending, sizeof(SPendingDeltaOp));
+}
+
+// Works out `current` as a list of copies from `previous` plus inserted commands, into `ops`, and returns roughly how
+// large it'd be on the wire; `table` and `scratch` are scratch space for the hash lookup. Nothing's encoded until write_delta.
+// Commands in regions that scrolled, as found by compute_dirty_rects, are looked for where they were before they moved.
+static size_t diff_frames(SRencache* previous, SRencache* current, array_t* table, array_t* scratch, array_t* ops) {
+  size_t previous_length = rencache_length(previous), current_length = rencache_length(current);
+  SCommandEntry* previous_commands = (SCommandEntry*)previous->commands.data;
+  SCommandEntry* current_commands = (SCommandEntry*)current->commands.data;
+  uint32_t buckets = 2;
+  while (buckets < previous_length * 2)
+    buckets <<= 1;
+  array_reserve(table, buckets * sizeof(uint32_t));
+  uint32_t* slots = (uint32_t*)table->data;
+  memset(slots, 0, buckets * sizeof(uint32_t));
+  for (size_t j = 0; j < previous_length; ++j) {
+    uint32_t h = previous_commands[j].hash & (buckets - 1);
+    while (slots[h])
+      h = (h + 1) & (buckets - 1);
+    slots[h] = j + 1;
+  }
+  array_clear(ops);
+  SRegion* regions = (SRegion*)current->regions.data;
+  size_t length = 0, region_count = current->regions.length / sizeof(SRegion), region = 0;
+  SDeltaOp op = {0};
+  size_t insert_start = 0;
+  for (size_t i = 0; i < current_length; ++i) {
+    if (op.copy_count && !op.insert_count && op.copy_start + op.copy_count < previous_length && commands_equal_shifted(current, i, previous, op.copy_start + op.copy_count, op.shift, scratch)) {
+      ++op.copy_count;
+      continue;
+    }
+    while (region < region_count && regions[region].start + regions[region].count <= i)
+      ++region;
+    int scroll = region < region_count && regions[region].start <= i ? regions[region].scroll : 0;
+    long match = -1;
+    int shift = 0;
+    for (int pass = scroll ? 0 : 1; pass < 2 && match == -1; ++pass) {
+      shift = pass ? 0 : scroll;
+      unsigned int key = shift ? shifted_hash(scratch, rencache_command(current, i), -shift) : current_commands[i].hash;
+      for (uint32_t h = key & (buckets - 1); slots[h]; h = (h + 1) & (buckets - 1)) {
+        if (commands_equal_shifted(current, i, previous, slots[h] - 1, shift, scratch)) {
+          match = slots[h] - 1;
+          break;
+        }
+      }
+    }
+    if (match == -1) {
+      if (!op.insert_count)
+        insert_start = i;
+      ++op.insert_count;
+      length += rencache_command(current, i)->size;
+    } else {
+      if (op.copy_count || op.insert_count)
+        append_delta_op(ops, &op, insert_start);
+      op = (SDeltaOp){ match, 1, shift, 0 };
+    }
+  }
+  if (op.copy_count || op.insert_count)
+    append_delta_op(ops, &op, insert_start);
+  return length + ops->length / sizeof(SPendingDeltaOp) * sizeof(SDeltaOp);
+}
+
+static void write_delta(SCommandCodec* codec, SStringTable* strings, SRencache* current, array_t* ops, array_t** streams) {
+  for (size_t i = 0; i < ops->length / sizeof(SPendingDeltaOp); ++i) {
+    SPendingDeltaOp* pending = &((SPendingDeltaOp*)ops->data)[i];
+    write_varint(streams[STREAM_OPS], pending->op.copy_start);
+    write_varint(streams[STREAM_OPS], pending->op.copy_count);
+    write_varint(streams[STREAM_OPS], zigzag_encode(pending->op.shift));
+    write_varint(streams[STREAM_OPS], pending->op.insert_count);
+    encode_commands(codec, strings, current, pending->insert_start, pending->op.insert_count, streams);
+  }
+}
+
+static void set_font_height(array_t* font_heights, int index, int height) {
+  int zero = 0;
+  while (font_heights->length < index * sizeof(int))
+    array_append(font_heights, &zero, sizeof(int));
+  ((int*)font_heights->data)[index - 1] = height;
+}
+
+static int get_font_height(array_t* font_heights, int index) {
+  return index >= 1 && index * sizeof(int) <= font_heights->length ? ((int*)font_heights->data)[index - 1] : 0;
+}
+
+// The area a command can touch under `clip`. Text width isn't known on this side, so text is assumed to run to the edge of the clip.
+static RenRect command_rect(array_t* font_heights, Command* command, RenRect clip) {
+  switch (command->type) {
+    case DRAW_RECT: return intersect_rects(((DrawRectCommand*)command)->rect, clip);
+    case DRAW_TEXT: {
+      DrawTextCommand* text = (DrawTextCommand*)command;
+      int x = floor(text->text_x), height = get_font_height(font_heights, text->fonts[0]);
+      return intersect_rects((RenRect){ x, text->y, clip.x + clip.width - x, height > 0 ? height : clip.y + clip.height - text->y }, clip);
+    }
+    default: return (RenRect){ 0, 0, 0, 0 };
+  }
+}
+
+static void index_regions(SRencache* rencache) {
+  array_clear(&rencache->regions);
+  SRegion region = { unclipped_rect, 0, 0, HASH_INITIAL, -1, 0, 0 };
+  for (size_t i = 0; i < rencache_length(rencache); ++i) {
+    Command* command = rencache_command(rencache, i);
+    if (command->type == SET_CLIP) {
+      if (region.count)
+        array_append(&rencache->regions, &region, sizeof(SRegion));
+      region = (SRegion){ ((SetClipCommand*)command)->rect, i + 1, 0, HASH_INITIAL, -1, 0, 0 };
+    } else {
+      ++region.count;
+      hash(&region.hash, &((SCommandEntry*)rencache->commands.data)[i].hash, sizeof(unsigned int));
+    }
+  }
+  if (region.count)
+    array_append(&rencache->regions, &region, sizeof(SRegion));
+}
+
+static void add_dirty_rect(array_t* dirty_rects, RenRect rect) {
+  if (rect.width > 0 && rect.height > 0)
+    array_append(dirty_rects, &rect, sizeof(RenRect));
+}
+
+// Where a command drawn under `clip` ends up once it's been moved down by `dy`, cut down to `bounds`.
+static RenRect moved_command_rect(array_t* font_heights, Command* command, RenRect clip, int dy, RenRect bounds) {
+  RenRect rect = command_rect(font_heights, command, clip);
+  rect.y += dy;
+  return intersect_rects(rect, bounds);
+}
+
+static void add_dirty_region(array_t* dirty_rects, array_t* font_heights, SRencache* rencache, SRegion* region, int dy, RenRect bounds) {
+  for (uint32_t i = region->start; i < region->start + region->count; ++i)
+    add_dirty_rect(dirty_rects, moved_command_rect(font_heights, rencache_command(rencache, i), region->clip, dy, bounds));
+}
+
+static int compare_hashed_commands(const void* a, const void* b) {
+  const SHashedCommand* ca = a, *cb = b;
+  if (ca->hash != cb->hash)
+    return ca->hash < cb->hash ? -1 : 1;
+  return ca->index < cb->index ? -1 : (ca->index > cb->index);
+}
+
+static int compare_ints(const void* a, const void* b) {
+  int ia = *(const int*)a, ib = *(const int*)b;
+  return ia < ib ? -1 : (ia > ib);
+}
+
+// A rect spanning the whole height of the clip draws the same thing, wherever it's scrolled to.
+static int scroll_invariant(Command* command, RenRect clip) {
+  RenRect* rect = &((DrawRectCommand*)command)->rect;
+  return command->type == DRAW_RECT && rect->y <= clip.y && rect->y + rect->height >= clip.y + clip.height;
+}
+
+// Whether the previous frame's i'th command, scrolled down by `dy` under `clip`, draws what the current frame's j'th does.
+static int scrolled_equal(SRencache* previous, size_t i, SRencache* current, size_t j, RenRect clip, int dy, array_t* scratch) {
+  return commands_equal_shifted(current, j, previous, i, scroll_invariant(rencache_command(previous, i), clip) ? 0 : dy, scratch);
+}
+
+// Sorts a region's commands by hash; with `dy`, by the hash they'd have once scrolled down by it.
+static SHashedCommand* sort_region(array_t* sorted, SRencache* rencache, SRegion* region, int dy, array_t* scratch) {
+  array_clear(sorted);
+  for (uint32_t i = region->start; i < region->start + region->count; ++i) {
+    Command* command = rencache_command(rencache, i);
+    SHashedCommand entry = { ((SCommandEntry*)rencache->commands.data)[i].hash, i };
+    if (dy && !scroll_invariant(command, region->clip))
+      entry.hash = shifted_hash(scratch, command, dy);
+    array_append(sorted, &entry, sizeof(SHashedCommand));
+  }
+  qsort(sorted->data, region->count, sizeof(SHashedCommand), compare_hashed_commands);
+  return (SHashedCommand*)sorted->data;
+}
+
+// Looks for the distance most of `region`'s commands have moved down by since `other`, the same region in the previous
+// frame; returns 0 if it doesn't look like it's been scrolled. Only commands that are the same as exactly one previous
+// one apart from their y get a say, as there's no telling where repeated ones, like blank lines, came from.
+static int detect_scroll(SServer* server, SRegion* other, SRegion* region) {
+  SRencache* previous = &server->previous_rencache, *current = &server->rencache;
+  if (region->count < MIN_SCROLLED_COMMANDS)
+    return 0;
+  array_t* sorted = &server->sorted_previous;
+  array_clear(sorted);
+  for (uint32_t i = other->start; i < other->start + other->count; ++i) {
+    Command* command = rencache_command(previous, i);
+    int* y = command_y(command);
+    if (y) {
+      SHashedCommand entry = { shifted_hash(&server->shifted_command, command, -*y), i };
+      array_append(sorted, &entry, sizeof(SHashedCommand));
+    }
+  }
+  size_t sorted_length = sorted->length / sizeof(SHashedCommand);
+  SHashedCommand* entries = (SHashedCommand*)sorted->data;
+  qsort(entries, sorted_length, sizeof(SHashedCommand), compare_hashed_commands);
+  array_t* offsets = &server->scroll_offsets;
+  array_clear(offsets);
+  for (uint32_t i = region->start; i < region->start + region->count; ++i) {
+    Command* command = rencache_command(current, i);
+    int* y = command_y(command);
+    if (!y)
+      continue;
+    unsigned int h = shifted_hash(&server->shifted_command, command, -*y);
+    size_t low = 0, high = sorted_length;
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (entries[middle].hash < h)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    if (low < sorted_length && entries[low].hash == h && (low + 1 == sorted_length || entries[low + 1].hash != h)) {
+      int dy = *y - *command_y(rencache_command(previous, entries[low].index));
+      array_append(offsets, &dy, sizeof(dy));
+    }
+  }
+  size_t count = offsets->length / sizeof(int), best_votes = 0;
+  int* dys = (int*)offsets->data, best = 0;
+  if (count < MIN_SCROLLED_COMMANDS)
+    return 0;
+  qsort(dys, count, sizeof(int), compare_ints);
+  for (size_t k = 0, run; k < count; k += run) {
+    for (run = 1; k + run < count && dys[k + run] == dys[k]; ++run);
+    if (run > best_votes) {
+      best = dys[k];
+      best_votes = run;
+    }
+  }
+  return best_votes >= MIN_SCROLLED_COMMANDS && best_votes * 2 >= count && (best < 0 ? -best : best) < region->clip.height ? best : 0;
+}
+
+static int rect_contains(RenRect outer, RenRect inner) {
+  return inner.x >= outer.x && inner.y >= outer.y && inner.x + inner.width <= outer.x + outer.width && inner.y + inner.height <= outer.y + outer.height;
+}
+
+static int rects_intersect(RenRect a, RenRect b) {
+  RenRect overlap = intersect_rects(a, b);
+  return overlap.width > 0 && overlap.height > 0;
+}
+
+// Picks which scrolled regions are sent as copies, largest first, so that a region scrolled along with the one around
+// it, like a view's text inside the view, is moved by that one's copy. A region that overlaps a copy it doesn't move
+// with isn't treated as scrolled after all, as copies have to be independent of each other.
+static void choose_copies(SServer* server) {
+  SRegion* regions = (SRegion*)server->rencache.regions.data;
+  size_t count = server->rencache.regions.length / sizeof(SRegion);
+  while (1) {
+    SRegion* largest = NULL;
+    for (size_t i = 0; i < count; ++i) {
+      if (regions[i].scroll && !regions[i].copy && (!largest || (int64_t)regions[i].clip.width * regions[i].clip.height > (int64_t)largest->clip.width * largest->clip.height))
+        largest = &regions[i];
+    }
+    if (!largest)
+      break;
+    SCopyRect* copies = (SCopyRect*)server->copy_rects.data;
+    size_t copy_count = server->copy_rects.length / sizeof(SCopyRect);
+    for (size_t k = 0; k < copy_count && !largest->copy; ++k) {
+      if (copies[k].dy == largest->scroll && rect_contains(copies[k].rect, largest->clip))
+        largest->copy = k + 1;
+      else if (rects_intersect(copies[k].rect, largest->clip))
+        largest->scroll = 0;
+    }
+    if (largest->scroll && !largest->copy) {
+      if (copy_count < MAX_COPY_RECTS) {
+        SCopyRect copy = { largest->clip, largest->scroll };
+        array_append(&server->copy_rects, &copy, sizeof(SCopyRect));
+        largest->copy = copy_count + 1;
+      } else
+        largest->scroll = 0;
+    }
+  }
+}
+
+// Returns 1 + the index of the last opaque rect covering all of `rect` among `regions`' commands, if `moving` is set for
+// their region; anything drawn before it can't be seen under `rect`. 0 if there's none.
+static uint32_t find_cover(SRencache* rencache, SRegion* regions, size_t count, char* moving, RenRect rect) {
+  uint32_t cover = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (uint32_t j = regions[i].start; moving[i] && j < regions[i].start + regions[i].count; ++j) {
+      DrawRectCommand* command = (DrawRectCommand*)rencache_command(rencache, j);
+      if (command->command.type == DRAW_RECT && command->color.a == 255 && rect_contains(command->rect, rect))
+        cover = j + 1;
+    }
+  }
+  return cover;
+}
+
+// The strip a scroll by `dy` leaves uncovered at the top or bottom of `rect`.
+static RenRect exposed_rect(RenRect rect, int dy) {
+  return dy > 0 ? (RenRect){ rect.x, rect.y, rect.width, dy } : (RenRect){ rect.x, rect.y + rect.height + dy, rect.width, -dy };
+}
+
+// Works out which parts of the window changed between the last frame sent and this one. Regions are paired up by clip rect;
+// for each pair that differs, the commands that only appear on one side are dirty. Unpaired regions are dirty as a whole.
+// Regions whose contents all moved up or down by the same distance become copy rects, and their commands are compared
+// with the previous ones moved by that distance; what the copy uncovers is dirty, and so is anything else the copy
+// moved that shouldn't have.
+static size_t compute_dirty_rects(SServer* server) {
+  SRencache* previous = &server->previous_rencache, *current = &server->rencache;
+  array_t* dirty_rects = &server->dirty_rects, *scratch = &server->shifted_command;
+  array_clear(dirty_rects);
+  array_clear(&server->copy_rects);
+  index_regions(current);
+  size_t previous_count = previous->regions.length / sizeof(SRegion), current_count = current->regions.length / sizeof(SRegion);
+  SRegion* previous_regions = (SRegion*)previous->regions.data, *current_regions = (SRegion*)current->regions.data;
+  for (size_t j = 0; j < previous_count; ++j)
+    previous_regions[j].pair = -1;
+  for (size_t i = 0; i < current_count; ++i) {
+    SRegion* region = &current_regions[i];
+    for (size_t j = i < previous_count ? i : 0, k = 0; k < previous_count; ++k, j = (j + 1) % previous_count) {
+      if (previous_regions[j].pair == -1 && !memcmp(&previous_regions[j].clip, &region->clip, sizeof(RenRect))) {
+        previous_regions[j].pair = i;
+        region->pair = j;
+        break;
+      }
+    }
+    if (region->pair != -1 && (previous_regions[region->pair].hash != region->hash || previous_regions[region->pair].count != region->count))
+      region->scroll = detect_scroll(server, &previous_regions[region->pair], region);
+  }
+  choose_copies(server);
+  for (size_t i = 0; i < current_count; ++i) {
+    SRegion* region = &current_regions[i], *other = region->pair != -1 ? &previous_regions[region->pair] : NULL;
+    int dy = region->scroll;
+    if (!other) {
+      add_dirty_region(dirty_rects, &server->font_heights, current, region, 0, region->clip);
+    } else if (dy || other->hash != region->hash || other->count != region->count) {
+      SHashedCommand* a = sort_region(&server->sorted_previous, previous, other, dy, scratch);
+      SHashedCommand* b = sort_region(&server->sorted_current, current, region, 0, scratch);
+      size_t initial_length = dirty_rects->length;
+      uint32_t ia = 0, ib = 0;
+      if (dy)
+        add_dirty_rect(dirty_rects, exposed_rect(region->clip, dy));
+      while (ia < other->count || ib < region->count) {
+        if (ib == region->count || (ia < other->count && a[ia].hash < b[ib].hash))
+          add_dirty_rect(dirty_rects, moved_command_rect(&server->font_heights, rencache_command(previous, a[ia++].index), region->clip, dy, region->clip));
+        else if (ia == other->count || b[ib].hash < a[ia].hash)
+          add_dirty_rect(dirty_rects, command_rect(&server->font_heights, rencache_command(current, b[ib++].index), region->clip));
+        else {
+          if (!scrolled_equal(previous, a[ia].index, current, b[ib].index, region->clip, dy, scratch)) {
+            add_dirty_rect(dirty_rects, moved_command_rect(&server->font_heights, rencache_command(previous, a[ia].index), region->clip, dy, region->clip));
+            add_dirty_rect(dirty_rects, command_rect(&server->font_heights, rencache_command(current, b[ib].index), region->clip));
+          }
+          ++ia, ++ib;
+        }
+      }
+      // same commands in a different order; only the overlap could have changed, but keep it simple.
+      if (dirty_rects->length == initial_length)
+        add_dirty_region(dirty_rects, &server->font_heights, current, region, 0, region->clip);
+    }
+  }
+  for (size_t j = 0; j < previous_count; ++j) {
+    if (previous_regions[j].pair == -1)
+      add_dirty_region(dirty_rects, &server->font_heights, previous, &previous_regions[j], 0, previous_regions[j].clip);
+  }
+  // copies move everything under them, including what belongs to regions that didn't move with them, unless it's
+  // hidden by something that did, like the background of the view that was scrolled.
+  array_reserve(&server->region_moves, current_count + previous_count);
+  char* current_moves = server->region_moves.data, *previous_moves = current_moves + current_count;
+  for (size_t k = 0; k < server->copy_rects.length / sizeof(SCopyRect); ++k) {
+    SCopyRect* copy = &((SCopyRect*)server->copy_rects.data)[k];
+    add_dirty_rect(dirty_rects, exposed_rect(copy->rect, copy->dy));
+    for (size_t i = 0; i < current_count; ++i)
+      current_moves[i] = current_regions[i].copy == (int)k + 1;
+    for (size_t j = 0; j < previous_count; ++j)
+      previous_moves[j] = previous_regions[j].pair != -1 && current_moves[previous_regions[j].pair];
+    uint32_t current_cover = find_cover(current, current_regions, current_count, current_moves, copy->rect);
+    uint32_t previous_cover = find_cover(previous, previous_regions, previous_count, previous_moves, copy->rect);
+    for (size_t i = 0; i < current_count; ++i) {
+      if (!current_moves[i] && current_regions[i].start >= current_cover && rects_intersect(current_regions[i].clip, copy->rect))
+        add_dirty_region(dirty_rects, &server->font_heights, current, &current_regions[i], 0, copy->rect);
+    }
+    for (size_t j = 0; j < previous_count; ++j) {
+      if (!previous_moves[j] && previous_regions[j].start >= previous_cover && rects_intersect(previous_regions[j].clip, copy->rect))
+        add_dirty_region(dirty_rects, &server->font_heights, previous, &previous_regions[j], copy->dy, copy->rect);
+    }
+  }
+  RenRect* rects = (RenRect*)dirty_rects->data;
+  size_t count = dirty_rects->length / sizeof(RenRect);
+  for (int merged = 1; merged; ) {
+    merged = 0;
+    for (size_t i = 0; i < count; ++i) {
+      for (size_t j = i + 1; j < count; ++j) {
+        if (rects_overlap(rects[i], rects[j])) {
+          rects[i] = merge_rects(rects[i], rects[j]);
+          rects[j--] = rects[--count];
+          merged = 1;
+        }
+      }
+    }
+  }
+  if (count > MAX_DIRTY_RECTS) {
+    for (size_t i = 1; i < count; ++i)
+      rects[0] = merge_rects(rects[0], rects[i]);
+    count = 1;
+  }
+  dirty_rects->length = count * sizeof(RenRect);
+  return count;
+}
+
+// Rebuilds a frame into `current` from `previous` and a delta produced by write_delta; returns -1 if the delta is malformed.
+static int apply_delta(SCommandCodec* codec, SStringTable* strings, SRencache* previous, SCommandReader* reader, SRencache* current) {
+  rencache_clear(current);
+  size_t previous_length = rencache_length(previous);
+  while (commands_remaining(reader)) {
+    uint64_t copy_start, copy_count, shift, insert_count;
+    if (read_stream_varint(reader, STREAM_OPS, &copy_start) || read_stream_varint(reader, STREAM_OPS, &copy_count) ||
+      read_stream_varint(reader, STREAM_OPS, &shift) || read_stream_varint(reader, STREAM_OPS, &insert_count))
+      return -1;
+    if (copy_start + copy_count > previous_length || insert_count > UINT32_MAX)
+      return -1;
+    SDeltaOp op = { copy_start, copy_count, zigzag_decode(shift), insert_count };
+    if (op.copy_count) {
+      size_t start = rencache_offset(previous, op.copy_start), offset = current->buffer.length;
+      array_append(&current->buffer, &previous->buffer.data[start], rencache_offset(previous, op.copy_start + op.copy_count) - start);
+      for (uint32_t i = 0; op.shift && i < op.copy_count; ++i) {
+        int* y = command_y((Command*)&current->buffer.data[offset + rencache_offset(previous, op.copy_start + i) - start]);
+        if (y)
+          *y += op.shift;
+      }
+    }
+    for (uint32_t i = 0; i < op.insert_count; ++i) {
+      if (decode_command(codec, strings, reader, &current->buffer))
+        return -1;
+    }
+  }
+  return index_commands(current);
+}
+
+static int decode_commands(SCommandCodec* codec, SStringTable* strings, SCommandReader* reader, SRencache* current) {
+  rencache_clear(current);
+  while (commands_remaining(reader)) {
+    if (decode_command(codec, strings, reader, &current->buffer))
+      return -1;
+  }
+  return index_commands(current);
+}
+
+static int train_dictionary(lua_State* L, SDuplex* duplex) {
+  size_t capacity = luaL_optinteger(L, 2, DEFAULT_DICTIONARY_SIZE);
+  luaL_argcheck(L, capacity > 0 && capacity <= MAX_DICTIONARY_SIZE, 2, "dictionary size out of range");
+  size_t samples = duplex->sample_sizes.length / sizeof(size_t);
+  if (!samples)
+    return luaL_error(L, "no samples captured; enable capture_samples");
+  array_t dictionary = {0};
+  array_reserve(&dictionary, capacity);
+  size_t length = ZDICT_trainFromBuffer(dictionary.data, capacity, duplex->samples.data, (size_t*)duplex->sample_sizes.data, samples);
+  if (ZDICT_isError(length)) {
+    free(dictionary.data);
+    return luaL_error(L, "can't train dictionary: %s", ZDICT_getErrorName(length));
+  }
+  lua_pushlstring(L, dictionary.data, length);
+  free(dictionary.data);
+  return 1;
+}
+
+static int viewer_count(SServer* server) {
+  return server->viewers.length / sizeof(SViewer*);
+}
+static SViewer* get_viewer(SServer* server, int i) {
+  return ((SViewer**)server->viewers.data)[i];
+}
+static void viewer_free(SViewer* viewer) {
+  duplex_free(&viewer->duplex);
+  free(viewer->event_batch.data);
+  free(viewer);
+}
+
+// Lets go of viewers that have disconnected; returns how many are left.
+static int check_viewers(SServer* server) {
+  int count = 0;
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (duplex_check(&viewer->duplex))
+      ((SViewer**)server->viewers.data)[count++] = viewer;
+    else
+      viewer_free(viewer);
+  }
+  server->viewers.length = count * sizeof(SViewer*);
+  return count;
+}
+
+// Packets waiting on the frames channel; it's only frames that viewers falling behind can be spared.
+static int duplex_queued(SDuplex* duplex) {
+  pthread_mutex_lock(&duplex->mutex);
+  int queued = duplex->channels[CHANNEL_FRAMES].length;
+  pthread_mutex_unlock(&duplex->mutex);
+  return queued;
+}
+
+// Whether a viewer can take another frame: it's only ever sent `frame_credit` frames ahead of what it's acked drawing,
+// so that what it shows is at most a round trip behind, however much the link between us could buffer.
+static int viewer_has_credit(SServer* server, SViewer* viewer) {
+  return !server->frame_credit || viewer->sent_frames - viewer->acked_frames < (uint32_t)server->frame_credit;
+}
+
+// Sends the packet in `buffer` to every viewer, each compressing it on its own sender thread; leaves `buffer` empty.
+// Frames are skipped for viewers that are too far behind to take them without waiting, rather than holding up everyone else.
+static void broadcast(SServer* server, EPacketType type, array_t* buffer, int frame) {
+  int count = viewer_count(server);
+  for (int i = 0; i < count; ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (frame && !viewer->stale && (duplex_queued(&viewer->duplex) == SEND_QUEUE_LENGTH || !viewer_has_credit(server, viewer)))
+      viewer->stale = VIEWER_BEHIND;
+    if (frame && viewer->stale)
+      continue;
+    array_t* packet = buffer;
+    if (i < count - 1) {
+      array_clear(&server->fanout_buffer);
+      array_append(&server->fanout_buffer, buffer->data, buffer->length);
+      packet = &server->fanout_buffer;
+    }
+    // each viewer's copy of a frame tells it how much of its own input the frame reflects.
+    if (frame) {
+      memcpy(&packet->data[offsetof(SFrameHeader, input_sequence)], &viewer->input_sequence, sizeof(uint32_t));
+      viewer->acked_sequence = viewer->input_sequence;
+      ++viewer->sent_frames;
+    }
+    send_compressed_buffer(&viewer->duplex, type, packet);
+  }
+  array_clear(buffer);
+}
+
+static int f_server_gc(lua_State* L) {
+  SServer* server = lua_touserdata(L, 1);
+  for (int i = 0; i < viewer_count(server); ++i)
+    viewer_free(get_viewer(server, i));
+  free(server->viewers.data);
+  for (size_t i = 0; i < server->pending.length / sizeof(SPendingConnection); ++i)
+    close(((SPendingConnection*)server->pending.data)[i].fd);
+  free(server->pending.data);
+  if (server->listening)
+    close(server->listening);
+  if (server->socket_path[0])
+    unlink_socket(server->socket_path);
+  free(server->dictionary.data);
+  rencache_free(&server->rencache);
+  rencache_free(&server->previous_rencache);
+  free(server->delta_table.data);
+  free(server->delta_ops.data);
+  string_table_free(&server->strings);
+  free(server->registered_fonts.data);
+  free(server->font_slots.data);
+  free(server->widths);
+  free(server->font_heights.data);
+  free(server->dirty_rects.data);
+  free(server->copy_rects.data);
+  free(server->region_moves.data);
+  free(server->sorted_previous.data);
+  free(server->sorted_current.data);
+  free(server->scroll_offsets.data);
+  free(server->shifted_command.data);
+  rencache_free(&server->optimized);
+  free(server->visible_rects.data);
+  for (int i = 0; i < STREAM_COUNT; ++i)
+    free(server->codec.streams[i].data);
+  free(server->font_registrations.data);
+  free(server->outgoing_buffer.data);
+  free(server->fanout_buffer.data);
+  trace_close(&server->trace);
+  return 0;
+}
+
+// Calls font:get_height() on the font at `idx`.
+static int call_font_height(lua_State* L, int idx) {
+  lua_getfield(L, idx, "get_height");
+  lua_pushvalue(L, idx < 0 ? idx - 1 : idx);
+  lua_call(L, 1, 1);
+  int height = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return height;
+}
+
+static double call_font_width(lua_State* L, int idx, const char* text, size_t length) {
+  lua_getfield(L, idx, "get_width");
+  lua_pushvalue(L, idx < 0 ? idx - 1 : idx);
+  lua_pushlstring(L, text, length);
+  lua_call(L, 2, 1);
+  double width = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return width;
+}
+
+// Only the hash of the font's contents goes out with it; the client asks for the contents if it doesn't have them cached.
+static int f_server_register_font(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  luaL_checkstring(L, 2);
+  struct RenFont* font = *(struct RenFont**)luaL_checkudata(L, 4, "Font");
+  lua_settop(L, 6);
+  // fonts are loaded from the same few files over and over, at different sizes, so only hash each file once.
+  lua_rawgeti(L, LUA_REGISTRYINDEX, server->font_hashes);
+  if (lua_getfield(L, -1, lua_tostring(L, 2)) != LUA_TSTRING) {
+    size_t length;
+    const char* contents = luaL_checklstring(L, 3, &length);
+    char key[64];
+    // FONT_HASH_LENGTH lowercase hex digits, which is what clients check for before using it as a file name.
+    snprintf(key, sizeof(key), "%016llx%012llx", (unsigned long long)hash64(contents, length), (unsigned long long)length);
+    lua_pop(L, 1);
+    lua_pushstring(L, key);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, lua_tostring(L, 2));
+    lua_rawgeti(L, LUA_REGISTRYINDEX, server->font_blobs);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+  int key_idx = lua_gettop(L);
+  SFont sfont = (SFont){ server->registered_fonts.length / sizeof(SFont) + 1, font };
+  array_append(&server->registered_fonts, &sfont, sizeof(SFont));
+  index_fonts(server);
+  set_font_height(&server->font_heights, sfont.index, call_font_height(L, 4));
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, key_idx);
+  lua_pushinteger(L, sfont.index);
+  lua_pushvalue(L, 5);
+  lua_pushvalue(L, 6);
+  push_lua(L, 5, &server->outgoing_buffer);
+  // kept, for viewers that connect later.
+  array_append(&server->font_registrations, &server->outgoing_buffer.length, sizeof(size_t));
+  array_append(&server->font_registrations, server->outgoing_buffer.data, server->outgoing_buffer.length);
+  broadcast(server, PACKET_FONT_REGISTER, &server->outgoing_buffer, 0);
+  lua_pushvalue(L, 4);
+  return 1;
+}
+
+static void send_font_blob(lua_State* L, SServer* server, SViewer* viewer) {
+  int top = lua_gettop(L);
+  if (pull_lua(L, &viewer->duplex.incoming_buffer) == 1 && lua_type(L, -1) == LUA_TSTRING) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, server->font_blobs);
+    lua_pushvalue(L, -2);
+    if (lua_rawget(L, -2) == LUA_TSTRING) {
+      lua_pushvalue(L, top + 1);
+      lua_pushvalue(L, -2);
+      push_lua(L, 2, &server->outgoing_buffer);
+      send_compressed_buffer(&viewer->duplex, PACKET_FONT_BLOB, &server->outgoing_buffer);
+    }
+  }
+  lua_settop(L, top);
+}
+
+static int f_server_begin_frame(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  rencache_clear(&server->rencache);
+  // frames tend to be about as big as the last one, so grow to that up front, rather than a doubling at a time.
+  array_reserve(&server->rencache.buffer, server->previous_rencache.buffer.length);
+  array_reserve(&server->rencache.commands, server->previous_rencache.commands.length);
+  server->clip = unclipped_rect;
+  server->has_caret = 0;
+  server->deferred = 0;
+  return 0;
+}
+
+// New viewers can take a keyframe straight away; ones that fell behind have to catch up with what they have queued
+// first, and have credit for it. Either can join in a keyframe, but only new ones start one; see catch_up_viewers.
+static int viewer_wants_keyframe(SServer* server, SViewer* viewer) {
+  return viewer->stale && duplex_queued(&viewer->duplex) < (viewer->stale == VIEWER_NEW ? SEND_QUEUE_LENGTH : 1) && viewer_has_credit(server, viewer);
+}
+
+// Starts every viewer that's ready for it over from a full frame, with an empty string table and palette.
+static void begin_keyframe(SServer* server) {
+  int string_table_size = server->string_table_size;
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (viewer_wants_keyframe(server, viewer))
+      viewer->stale = 0;
+    if (viewer->string_table_size < string_table_size)
+      string_table_size = viewer->string_table_size;
+  }
+  string_table_free(&server->strings);
+  string_table_init(&server->strings, string_table_size);
+  memset(server->codec.palette, 0, sizeof(server->codec.palette));
+  rencache_clear(&server->previous_rencache);
+  server->keyframe = 0;
+}
+
+// Whether two rects of the same color, drawn one after the other, can be drawn as one: together they make a rect, and
+// unless they're opaque, they don't overlap.
+static int rects_mergeable(RenRect a, RenRect b, int opaque) {
+  if (a.y == b.y && a.height == b.height)
+    return opaque ? b.x <= a.x + a.width && a.x <= b.x + b.width : b.x == a.x + a.width || a.x == b.x + b.width;
+  if (a.x == b.x && a.width == b.width)
+    return opaque ? b.y <= a.y + a.height && a.y <= b.y + b.height : b.y == a.y + a.height || a.y == b.y + b.height;
+  return 0;
+}
+
+// Leaves out of the current frame what it draws that can't be seen: commands entirely outside their clip, and ones
+// entirely under an opaque rect drawn later, of which only the MAX_OCCLUDERS largest are checked against. Rects of the
+// same color drawn one after the other are merged where they can be, and clip changes are only kept where something's
+// drawn under them that they change. The caret's rect is never merged, as clients look for it to echo typing. The
+// frame's checksum is kept as recorded, so that a frame that draws the same as the last is still skipped.
+static void optimize_frame(SServer* server) {
+  SRencache* frame = &server->rencache;
+  size_t count = rencache_length(frame);
+  array_reserve(&server->visible_rects, count * sizeof(RenRect));
+  // what each command draws, within its clip, or for clip changes, the clip; empty for commands left out.
+  RenRect* visible = (RenRect*)server->visible_rects.data, clip = unclipped_rect;
+  for (size_t i = 0; i < count; ++i) {
+    Command* command = rencache_command(frame, i);
+    if (command->type == SET_CLIP) {
+      visible[i] = clip = ((SetClipCommand*)command)->rect;
+      continue;
+    }
+    visible[i] = command_rect(&server->font_heights, command, clip);
+    if (visible[i].width <= 0 || visible[i].height <= 0) {
+      visible[i].width = 0;
+      ++server->stats.outside_clip;
+    }
+  }
+  RenRect occluders[MAX_OCCLUDERS];
+  int occluder_count = 0;
+  for (size_t i = count; i-- > 0; ) {
+    Command* command = rencache_command(frame, i);
+    if (command->type == SET_CLIP || !visible[i].width)
+      continue;
+    int covered = 0, smallest = 0;
+    for (int k = 0; k < occluder_count && !covered; ++k) {
+      covered = rect_contains(occluders[k], visible[i]);
+      if ((int64_t)occluders[k].width * occluders[k].height < (int64_t)occluders[smallest].width * occluders[smallest].height)
+        smallest = k;
+    }
+    if (covered) {
+      visible[i].width = 0;
+      ++server->stats.covered;
+    } else if (command->type == DRAW_RECT && ((DrawRectCommand*)command)->color.a == 255) {
+      if (occluder_count < MAX_OCCLUDERS)
+        occluders[occluder_count++] = visible[i];
+      else if ((int64_t)visible[i].width * visible[i].height > (int64_t)occluders[smallest].width * occluders[smallest].height)
+        occluders[smallest] = visible[i];
+    }
+  }
+  SRencache* out = &server->optimized;
+  rencache_clear(out);
+  array_reserve(&out->buffer, frame->buffer.length);
+  array_reserve(&out->commands, frame->commands.length);
+  // the clip clients have as of what's been written so far, and the one the next command drawn is under.
+  RenRect current = unclipped_rect, pending = unclipped_rect;
+  size_t clips = 0, last_rect = SIZE_MAX;
+  for (size_t i = 0; i < count; ++i) {
+    Command* command = rencache_command(frame, i);
+    if (command->type == SET_CLIP) {
+      pending = visible[i];
+      ++clips;
+      continue;
+    }
+    if (!visible[i].width)
+      continue;
+    if (memcmp(&pending, &current, sizeof(RenRect))) {
+      SetClipCommand* set_clip = (SetClipCommand*)reserve_command(out, SET_CLIP, sizeof(SetClipCommand));
+      set_clip->rect = current = pending;
+      commit_command(out);
+      last_rect = SIZE_MAX;
+      --clips;
+    }
+    if (command->type == DRAW_RECT && last_rect != SIZE_MAX) {
+      DrawRectCommand* previous = (DrawRectCommand*)rencache_command(out, last_rect), *rect = (DrawRectCommand*)command;
+      int caret = server->has_caret && (!memcmp(&previous->rect, &server->caret.rect, sizeof(RenRect)) || !memcmp(&rect->rect, &server->caret.rect, sizeof(RenRect)));
+      if (!caret && !memcmp(&previous->color, &rect->color, sizeof(RenColor)) && rects_mergeable(previous->rect, rect->rect, rect->color.a == 255)) {
+        previous->rect = merge_rects(previous->rect, rect->rect);
+        ((SCommandEntry*)out->commands.data)[last_rect].hash = hash_bytes(previous, previous->command.size);
+        ++server->stats.merged_rects;
+        continue;
+      }
+    }
+    last_rect = command->type == DRAW_RECT ? rencache_length(out) : SIZE_MAX;
+    push_command(out, command);
+  }
+  server->stats.redundant_clips += clips;
+  out->checksum = frame->checksum;
+  rencache_swap(frame, out);
+}
+
+// Encodes the current frame into `packet`, as a delta against the previous one if that's smaller; returns its type.
+static EPacketType encode_frame(SServer* server, int keyframe, array_t* packet) {
+  array_t* streams[STREAM_COUNT];
+  EPacketType type = PACKET_COMMAND_BUFFER;
+  if (keyframe)
+    begin_keyframe(server);
+  SFrameHeader header = { (rencache_length(&server->previous_rencache) ? 0 : FRAME_REDRAW_ALL) | (server->codec.columnar ? FRAME_COLUMNAR : 0) | (keyframe ? FRAME_RESET : 0) | (server->has_caret ? FRAME_CARET : 0), compute_dirty_rects(server) };
+  header.copy_count = server->copy_rects.length / sizeof(SCopyRect);
+  array_append(packet, &header, sizeof(header));
+  array_append(packet, server->dirty_rects.data, server->dirty_rects.length);
+  array_append(packet, server->copy_rects.data, server->copy_rects.length);
+  if (server->has_caret)
+    array_append(packet, &server->caret, sizeof(SCaret));
+  if (keyframe) {
+    uint32_t string_table_size = server->strings.max_memory;
+    array_append(packet, &string_table_size, sizeof(string_table_size));
+  }
+  begin_commands(&server->codec, packet, streams);
+  // the client holds the last frame we sent it; if a delta against that is smaller than the whole frame, send that instead.
+  if (rencache_length(&server->previous_rencache) && diff_frames(&server->previous_rencache, &server->rencache, &server->delta_table, &server->shifted_command, &server->delta_ops) < server->rencache.buffer.length) {
+    write_delta(&server->codec, &server->strings, &server->rencache, &server->delta_ops, streams);
+    type = PACKET_COMMAND_DELTA;
+  } else
+    encode_commands(&server->codec, &server->strings, &server->rencache, 0, rencache_length(&server->rencache), streams);
+  end_commands(&server->codec, packet);
+  return type;
+}
+
+// Starts a keyframe if any viewer wants one; returns whether any viewer can take a frame now.
+static int viewers_ready(SServer* server) {
+  int ready = 0;
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (viewer->stale == VIEWER_NEW && viewer_wants_keyframe(server, viewer))
+      server->keyframe = 1;
+    else if (viewer->stale || !viewer_has_credit(server, viewer))
+      continue;
+    ready = 1;
+  }
+  return ready;
+}
+
+// Sends each viewer that fell behind, and can take a frame again, the last frame everyone else was sent, whole, and
+// then the string table and palette as they stand; it follows the same deltas as everyone else from there on, and
+// nobody else has to start over. The frame's written without either, and only takes the caret along if it's the one
+// it was drawn with.
+static void catch_up_viewers(SServer* server) {
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (viewer->stale != VIEWER_BEHIND || !viewer_wants_keyframe(server, viewer) || !rencache_length(&server->previous_rencache))
+      continue;
+    array_t* packet = &server->outgoing_buffer;
+    array_t* streams[STREAM_COUNT];
+    int caret = server->has_caret && !server->deferred;
+    SFrameHeader header = { FRAME_REDRAW_ALL | FRAME_SYNC | (server->codec.columnar ? FRAME_COLUMNAR : 0) | (caret ? FRAME_CARET : 0), 0, 0, viewer->input_sequence };
+    array_clear(packet);
+    array_append(packet, &header, sizeof(header));
+    if (caret)
+      array_append(packet, &server->caret, sizeof(SCaret));
+    size_t state_offset = packet->length;
+    uint32_t state_length = 0;
+    array_append(packet, &state_length, sizeof(state_length));
+    write_shared_state(&server->codec, &server->strings, packet);
+    state_length = packet->length - state_offset - sizeof(state_length);
+    memcpy(&packet->data[state_offset], &state_length, sizeof(state_length));
+    RenColor palette[PALETTE_SIZE];
+    SStringTable unshared = {0};
+    memcpy(palette, server->codec.palette, sizeof(palette));
+    memset(server->codec.palette, 0, sizeof(server->codec.palette));
+    begin_commands(&server->codec, packet, streams);
+    encode_commands(&server->codec, &unshared, &server->previous_rencache, 0, rencache_length(&server->previous_rencache), streams);
+    end_commands(&server->codec, packet);
+    memcpy(server->codec.palette, palette, sizeof(palette));
+    viewer->stale = 0;
+    viewer->acked_sequence = viewer->input_sequence;
+    ++viewer->sent_frames;
+    ++server->stats.catch_ups;
+    send_compressed_buffer(&viewer->duplex, PACKET_COMMAND_BUFFER, packet);
+    array_clear(packet);
+  }
+}
+
+// With no frame to show it, tells each viewer that typed something it predicted that the input's been processed, so
+// it can stop predicting it; only then, as a frame that does change carries the same news.
+static void ack_input(SServer* server) {
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (viewer->stale || (int32_t)(viewer->predicted_sequence - viewer->acked_sequence) <= 0)
+      continue;
+    array_clear(&server->outgoing_buffer);
+    array_append(&server->outgoing_buffer, &viewer->input_sequence, sizeof(uint32_t));
+    send_compressed_buffer(&viewer->duplex, PACKET_INPUT_ACK, &server->outgoing_buffer);
+    array_clear(&server->outgoing_buffer);
+    viewer->acked_sequence = viewer->input_sequence;
+  }
+}
+
+// Encodes the frame in rencache, and sends it to every viewer that can take it.
+static void send_frame(SServer* server, uint64_t start) {
+  int keyframe = server->keyframe;
+  // traced as drawn, before it's optimized, and so before it's known how it'll be encoded.
+  trace_write(&server->trace, TRACE_FRAME, PACKET_NONE, 0, server->rencache.buffer.data, server->rencache.buffer.length);
+  if (server->optimize_commands)
+    optimize_frame(server);
+  EPacketType type = encode_frame(server, keyframe, &server->outgoing_buffer);
+  broadcast(server, type, &server->outgoing_buffer, 1);
+  record_frame(&server->stats, rencache_length(&server->rencache), keyframe, start);
+  rencache_swap(&server->rencache, &server->previous_rencache);
+  server->deferred = 0;
+}
+
+static int f_server_end_frame(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  uint64_t start = get_time();
+  int viewers = check_viewers(server), ready = viewers_ready(server);
+  if (viewers && (server->keyframe || server->rencache.checksum != server->previous_rencache.checksum)) {
+    if (ready)
+      send_frame(server, start);
+    else {
+      // every viewer has as many frames in flight as it can; poll_event sends this one once one of them acks, unless
+      // another's drawn first. Either way, it goes out as a delta against the last one sent.
+      server->deferred = 1;
+      ++server->stats.deferred_frames;
+    }
+    lua_pushboolean(L, ready);
+  } else {
+    if (viewers)
+      ++server->stats.skipped_frames;
+    // a held back frame will carry the acks once it goes out.
+    if (viewers && !server->deferred)
+      ack_input(server);
+    lua_pushboolean(L, 0);
+  }
+  catch_up_viewers(server);
+  return 1;
+}
+
+
+static int color_value_error(lua_State *L, int idx, int table_idx) {
+  const char *type, *msg;
+  // generate an appropriate error message
+  if (luaL_getmetafield(L, -1, "__name") == LUA_TSTRING) {
+    type = lua_tostring(L, -1); // metatable name
   } else if (lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
     type = "light userdata"; // special name for light userdata
   } else {
@@ -393,182 +3471,1309 @@ static RenColor checkcolor(lua_State *L, int idx, int def) {
   return color;
 }
 
-
-static int f_server_set_clip_rect(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  lua_Number x = luaL_checknumber(L, 2);
-  lua_Number y = luaL_checknumber(L, 3);
-  lua_Number w = luaL_checknumber(L, 4);
-  lua_Number h = luaL_checknumber(L, 5);
-  SetClipCommand cmd = { { SET_CLIP, sizeof(SetClipCommand) }, rect_to_grid(x, y, w, h) };
-  push_command(&server->rencache, &cmd.command);
+
+static int f_server_set_clip_rect(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_Number x = luaL_checknumber(L, 2);
+  lua_Number y = luaL_checknumber(L, 3);
+  lua_Number w = luaL_checknumber(L, 4);
+  lua_Number h = luaL_checknumber(L, 5);
+  SetClipCommand* cmd = (SetClipCommand*)reserve_command(&server->rencache, SET_CLIP, sizeof(SetClipCommand));
+  cmd->rect = server->clip = rect_to_grid(x, y, w, h);
+  commit_command(&server->rencache);
+  return 0;
+}
+
+static int f_server_draw_rect(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_Number x = luaL_checknumber(L, 2);
+  lua_Number y = luaL_checknumber(L, 3);
+  lua_Number w = luaL_checknumber(L, 4);
+  lua_Number h = luaL_checknumber(L, 5);
+  RenColor color = checkcolor(L, 6, 255);
+  DrawRectCommand* cmd = (DrawRectCommand*)reserve_command(&server->rencache, DRAW_RECT, sizeof(DrawRectCommand));
+  cmd->rect = rect_to_grid(x, y, w, h);
+  cmd->color = color;
+  commit_command(&server->rencache);
+  return 0;
+}
+
+// Resolves the font or font group at `idx` to registered font indices, with unused fallbacks left 0; returns whether
+// they're all registered.
+static int check_fonts(lua_State* L, SServer* server, int idx, int fonts[FONT_FALLBACK_MAX]) {
+  int count = lua_type(L, idx) == LUA_TTABLE ? luaL_len(L, idx) : 1, registered = 1;
+  count = count > FONT_FALLBACK_MAX ? FONT_FALLBACK_MAX : count;
+  memset(fonts, 0, sizeof(int) * FONT_FALLBACK_MAX);
+  for (int i = 0; i < count; i++) {
+    if (lua_type(L, idx) == LUA_TTABLE)
+      lua_rawgeti(L, idx, i + 1);
+    else
+      lua_pushvalue(L, idx);
+    struct RenFont** font = lua_touserdata(L, -1);
+    luaL_argcheck(L, font != NULL, idx, "font expected");
+    fonts[i] = get_font_index(server, *font);
+    registered = registered && fonts[i] != -1;
+    lua_pop(L, 1);
+  }
+  return registered;
+}
+
+static double measure_text(lua_State* L, SServer* server, int idx, const char* text, size_t length) {
+  if (server->measure == LUA_NOREF)
+    return call_font_width(L, idx, text, length);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, server->measure);
+  lua_pushvalue(L, idx);
+  lua_pushlstring(L, text, length);
+  lua_call(L, 2, 1);
+  double width = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return width;
+}
+
+// The width of `text` in the font or group at `idx`, from the cache if it's been measured before. Only registered
+// fonts are cached, as it's their index that tells them apart, and not text with tabs, as it depends on the tab size.
+static double text_width(lua_State* L, SServer* server, int idx, const int* fonts, const char* text, size_t length) {
+  if (!fonts || !server->widths || memchr(text, '\t', length))
+    return measure_text(L, server, idx, text, length);
+  uint64_t seed = fonts[1] ? XXH64(fonts, sizeof(int) * FONT_FALLBACK_MAX, 0) : (uint64_t)fonts[0];
+  uint64_t hash = XXH64(text, length, seed) | 1;
+  SWidthEntry* set = &server->widths[(hash >> 32) % server->width_sets * WIDTH_CACHE_WAYS], *oldest = set;
+  ++server->width_clock;
+  for (int i = 0; i < WIDTH_CACHE_WAYS; ++i) {
+    if (set[i].hash == hash && set[i].length == length) {
+      set[i].used = server->width_clock;
+      ++server->stats.width_hits;
+      return set[i].width;
+    }
+    if (!set[i].hash || (oldest->hash && (int32_t)(set[i].used - oldest->used) < 0))
+      oldest = &set[i];
+  }
+  ++server->stats.width_misses;
+  double width = measure_text(L, server, idx, text, length);
+  *oldest = (SWidthEntry){ hash, length, server->width_clock, width };
+  return width;
+}
+
+// Returns where the text ends, like renderer.draw_text; it's only recorded while someone's watching.
+static int f_server_draw_text(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  int fonts[FONT_FALLBACK_MAX];
+  int registered = check_fonts(L, server, 2, fonts);
+  size_t len;
+  const char *text = luaL_checklstring(L, 3, &len);
+  double x = luaL_checknumber(L, 4);
+  if (viewer_count(server)) {
+    if (!registered)
+      return luaL_error(L, "can't find unregistered font");
+    int y = luaL_checknumber(L, 5);
+    RenColor color = checkcolor(L, 6, 255);
+    DrawTextCommand* cmd = (DrawTextCommand*)reserve_command(&server->rencache, DRAW_TEXT, sizeof(DrawTextCommand) + len);
+    cmd->color = color;
+    memcpy(cmd->fonts, fonts, sizeof(fonts));
+    cmd->text_x = x;
+    cmd->y = y;
+    cmd->len = len;
+    cmd->tab_size = 2;
+    memcpy(cmd->text, text, len);
+    commit_command(&server->rencache);
+  }
+  lua_pushnumber(L, x + text_width(L, server, 2, registered ? fonts : NULL, text, len));
+  return 1;
+}
+
+// Measures text like font:get_width, from the same cache as draw_text. Whatever's passed after the text, like a tab
+// offset, changes the width, so with any of that it's measured afresh, and returns whatever the renderer does.
+static int f_server_get_width(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  int top = lua_gettop(L);
+  if (top > 3) {
+    lua_checkstack(L, top);
+    if (server->measure == LUA_NOREF)
+      lua_getfield(L, 2, "get_width");
+    else
+      lua_rawgeti(L, LUA_REGISTRYINDEX, server->measure);
+    for (int i = 2; i <= top; ++i)
+      lua_pushvalue(L, i);
+    lua_call(L, top - 1, LUA_MULTRET);
+    return lua_gettop(L) - top;
+  }
+  int fonts[FONT_FALLBACK_MAX];
+  int registered = check_fonts(L, server, 2, fonts);
+  size_t len;
+  const char *text = luaL_checklstring(L, 3, &len);
+  lua_pushnumber(L, text_width(L, server, 2, registered ? fonts : NULL, text, len));
+  return 1;
+}
+
+// Says where text typed this frame would go: the caret's x, y, w and h, the font and color text's drawn in there, and
+// the caret's color. Clients use it to draw typing before the frame with it comes back. Without arguments, or if it
+// isn't called before end_frame, there's nowhere to type.
+static int f_server_set_caret(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  if (lua_isnoneornil(L, 2)) {
+    server->has_caret = 0;
+    return 0;
+  }
+  RenRect rect = rect_to_grid(luaL_checknumber(L, 2), luaL_checknumber(L, 3), luaL_checknumber(L, 4), luaL_checknumber(L, 5));
+  // of a font group, the first font is what's typed in.
+  if (lua_type(L, 6) == LUA_TTABLE)
+    lua_rawgeti(L, 6, 1);
+  else
+    lua_pushvalue(L, 6);
+  luaL_argcheck(L, lua_type(L, -1) == LUA_TUSERDATA, 6, "font expected");
+  int font = get_font_index(server, *(struct RenFont**)lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  // clients can't draw in a font they haven't been sent.
+  server->caret = (SCaret){ server->clip, rect, font, checkcolor(L, 7, 255), checkcolor(L, 8, 255) };
+  server->has_caret = font != -1;
+  return 0;
+}
+
+
+// Accepts a connection on the listening socket; returns its fd, or -1.
+static int accept_connection(SServer* server, char* address) {
+  struct sockaddr_storage peer_addr = {0};
+  socklen_t peer_size = sizeof(peer_addr);
+  int fd = accept(server->listening, (struct sockaddr*)&peer_addr, &peer_size);
+  if (fd != -1)
+    snprintf(address, 64, "%s", peer_addr.ss_family == AF_INET ? inet_ntoa(((struct sockaddr_in*)&peer_addr)->sin_addr) : "local");
+  return fd;
+}
+
+// Takes the first pending connection that has something to read, which should be its handshake; ones that have had
+// HANDSHAKE_TIMEOUT seconds to send it are closed. Returns whether there was one.
+static int take_pending_connection(SServer* server, int* fd, char* address) {
+  SPendingConnection* pending = (SPendingConnection*)server->pending.data;
+  size_t count = server->pending.length / sizeof(SPendingConnection), kept = 0;
+  uint64_t now = get_time();
+  int found = 0;
+  for (size_t i = 0; i < count; ++i) {
+    struct pollfd readable = { pending[i].fd, POLLIN, 0 };
+    if (!found && poll(&readable, 1, 0) > 0) {
+      *fd = pending[i].fd;
+      memcpy(address, pending[i].address, sizeof(pending[i].address));
+      found = 1;
+    } else if (now - pending[i].accepted_at > HANDSHAKE_TIMEOUT * 1000000000ULL)
+      close(pending[i].fd);
+    else
+      pending[kept++] = pending[i];
+  }
+  server->pending.length = kept * sizeof(SPendingConnection);
+  return found;
+}
+
+// Waits for a client to connect, or with `false`, only takes one that's already waiting; returns its address, and
+// whether it's resuming this session after having been disconnected.
+static int f_server_accept(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  char address[64];
+  int fd;
+  if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+    // connections wait on the side until their handshake's arrived, so that one that never sends it can't hold us up.
+    struct pollfd listening = { server->listening, POLLIN, 0 };
+    if (poll(&listening, 1, 0) > 0 && (fd = accept_connection(server, address)) != -1) {
+      SPendingConnection connection = { fd, get_time() };
+      memcpy(connection.address, address, sizeof(address));
+      array_append(&server->pending, &connection, sizeof(connection));
+    }
+    if (!take_pending_connection(server, &fd, address))
+      return 0;
+  } else if ((fd = accept_connection(server, address)) == -1)
+    return luaL_error(L, "can't accept: %s", strerror(errno));
+  SViewer* viewer = calloc(1, sizeof(SViewer));
+  viewer->duplex.fd = fd;
+  viewer->duplex.capture_samples = server->capture_samples;
+  memcpy(viewer->duplex.levels, server->compression_levels, sizeof(server->compression_levels));
+  viewer->duplex.adaptive = server->adaptive_compression;
+  memcpy(viewer->address, address, sizeof(address));
+  viewer->duplex.trace = &server->trace;
+  viewer->duplex.connection = server->connections++;
+  // anyone who can reach a unix domain socket is on this machine, and so can share memory with us, if they ask to.
+  SHandshake handshake = { .window_log = server->window_log, .string_table_size = server->string_table_size, .transport = server->socket_path[0] ? TRANSPORT_SHARED_MEMORY : TRANSPORT_SOCKET };
+  memcpy(handshake.token, server->token, SESSION_TOKEN_SIZE);
+  if (duplex_handshake(&viewer->duplex, &handshake, &server->dictionary, 1)) {
+    lua_pushfstring(L, "can't handshake with %s", viewer->address);
+    viewer_free(viewer);
+    return lua_error(L);
+  }
+  set_socket_timeout(fd, 0);
+  int flags = fcntl(viewer->duplex.fd, F_GETFL, 0);
+  fcntl(viewer->duplex.fd, F_SETFL, flags | O_NONBLOCK);
+  viewer->string_table_size = handshake.string_table_size;
+  viewer->stale = VIEWER_NEW;
+  array_append(&server->viewers, &viewer, sizeof(viewer));
+  // a client coming back to this session still has the fonts it was sent, and is only sent the ones registered since;
+  // everyone else is caught up on all of them. Either way, its first frame is a keyframe.
+  int resumed = memcmp(handshake.token, server->token, SESSION_TOKEN_SIZE) == 0;
+  uint32_t skipped = resumed ? handshake.fonts : 0;
+  for (size_t offset = 0, i = 0; offset < server->font_registrations.length; ++i) {
+    size_t length;
+    memcpy(&length, &server->font_registrations.data[offset], sizeof(size_t));
+    offset += sizeof(size_t);
+    if (i >= skipped) {
+      array_clear(&server->fanout_buffer);
+      array_append(&server->fanout_buffer, &server->font_registrations.data[offset], length);
+      send_compressed_buffer(&viewer->duplex, PACKET_FONT_REGISTER, &server->fanout_buffer);
+    }
+    offset += length;
+  }
+  lua_pushstring(L, viewer->address);
+  lua_pushboolean(L, resumed);
+  return 2;
+}
+
+
+static int f_server_is_open(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_pushboolean(L, check_viewers(server) > 0);
+  return 1;
+}
+
+// Returns the addresses of the attached viewers, starting with the input owner.
+static int f_server_viewers(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_createtable(L, check_viewers(server), 0);
+  for (int i = 0; i < viewer_count(server); ++i) {
+    lua_pushstring(L, get_viewer(server, i)->address);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+// Hands input over to the viewer at the given index into server:viewers().
+static int f_server_set_input_owner(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  int index = luaL_checkinteger(L, 2) - 1;
+  luaL_argcheck(L, index >= 0 && index < viewer_count(server), 2, "no such viewer");
+  SViewer** viewers = (SViewer**)server->viewers.data;
+  SViewer* owner = viewers[index];
+  memmove(&viewers[1], &viewers[0], index * sizeof(SViewer*));
+  viewers[0] = owner;
+  return 0;
+}
+
+// Returns what the session has cost so far: frame counts, commands per frame and the time spent encoding them, and for
+// each viewer, what's been sent and received of each type of packet. Times are in seconds; histograms count how many
+// took under 1, 2, 4, ... microseconds, up to a last bucket for anything longer.
+static int f_server_stats(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_newtable(L);
+  push_frame_stats(L, &server->stats, "encode_time");
+  lua_pushinteger(L, server->stats.skipped_frames);
+  lua_setfield(L, -2, "skipped_frames");
+  lua_pushinteger(L, server->stats.deferred_frames);
+  lua_setfield(L, -2, "deferred_frames");
+  lua_pushinteger(L, server->stats.catch_ups);
+  lua_setfield(L, -2, "catch_ups");
+  lua_pushinteger(L, server->stats.width_hits);
+  lua_setfield(L, -2, "width_hits");
+  lua_pushinteger(L, server->stats.width_misses);
+  lua_setfield(L, -2, "width_misses");
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, server->stats.outside_clip);
+  lua_setfield(L, -2, "outside_clip");
+  lua_pushinteger(L, server->stats.covered);
+  lua_setfield(L, -2, "covered");
+  lua_pushinteger(L, server->stats.merged_rects);
+  lua_setfield(L, -2, "merged_rects");
+  lua_pushinteger(L, server->stats.redundant_clips);
+  lua_setfield(L, -2, "redundant_clips");
+  lua_setfield(L, -2, "removed_commands");
+  lua_createtable(L, viewer_count(server), 0);
+  for (int i = 0; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    lua_newtable(L);
+    lua_pushstring(L, viewer->address);
+    lua_setfield(L, -2, "address");
+    push_duplex_stats(L, &viewer->duplex);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "viewers");
+  return 1;
+}
+
+// Starts recording a trace of the session to the given path, replacing any trace being recorded; without one, stops.
+static int f_server_record(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  const char* path = luaL_optstring(L, 2, NULL);
+  if (!path) {
+    trace_close(&server->trace);
+    return 0;
+  }
+  if (trace_open(&server->trace, path, TRACE_SERVER))
+    return luaL_error(L, "can't record to %s: %s", path, strerror(errno));
+  // so that the frames sent can be decoded from the trace alone.
+  server->keyframe = 1;
+  return 0;
+}
+
+static int f_server_reset_stats(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  memset(&server->stats, 0, sizeof(server->stats));
+  for (int i = 0; i < viewer_count(server); ++i)
+    duplex_reset_stats(&get_viewer(server, i)->duplex);
+  return 0;
+}
+
+// Returns the level each viewer currently compresses the given type of packet at, in the order of server:viewers().
+// With a level, fixes it at that for every viewer, including later ones; with `false`, lets it adapt again.
+static int f_server_compression_level(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  EPacketType type;
+  int value, fixed;
+  if (check_compression_level(L, &type, &value, &fixed)) {
+    set_compression_level(&server->compression_levels[type], value, fixed);
+    for (int i = 0; i < viewer_count(server); ++i)
+      duplex_set_compression_level(&get_viewer(server, i)->duplex, type, value, fixed);
+  }
+  lua_checkstack(L, viewer_count(server));
+  for (int i = 0; i < viewer_count(server); ++i)
+    lua_pushinteger(L, duplex_compression_level(&get_viewer(server, i)->duplex, type));
+  return viewer_count(server);
+}
+
+
+// Gets the next packet from a viewer, if there's one, reading more from its connection only if `read` is set; returns
+// whether there is. Frame acks are taken as they come, and never handed out.
+static int viewer_next_packet(SViewer* viewer, int read) {
+  SDuplex* duplex = &viewer->duplex;
+  while (1) {
+    if (!duplex_next_packet(duplex) && read && duplex->fd)
+      recv_compressed_buffer(duplex);
+    if (duplex->incoming_packet_type != PACKET_FRAME_ACK)
+      return duplex->incoming_packet_type != PACKET_NONE;
+    uint32_t acked;
+    // an ack for frames that were never sent would leave it with credit for good.
+    if (duplex->incoming_buffer.length == sizeof(uint32_t)) {
+      memcpy(&acked, duplex->incoming_buffer.data, sizeof(uint32_t));
+      if ((int32_t)(viewer->sent_frames - acked) >= 0)
+        viewer->acked_frames = acked;
+    }
+    array_clear(&duplex->incoming_buffer);
+    duplex->incoming_packet_type = PACKET_NONE;
+  }
+}
+
+// Counts an event batch just received from a viewer, taking the BATCH_ flags off its end; returns 0 if there weren't any.
+static int take_event_batch(SViewer* viewer, array_t* batch) {
+  if (!batch->length)
+    return 0;
+  uint8_t flags = batch->data[--batch->length];
+  ++viewer->input_sequence;
+  if (flags & BATCH_PREDICTED)
+    viewer->predicted_sequence = viewer->input_sequence;
+  return 1;
+}
+
+// Waits until something arrives from any viewer, or anyone connects, for up to `timeout` seconds, or for good without
+// one; returns whether anything has. Whatever it is, poll_event deals with it: the input owner's events, and everyone's
+// font requests, while connections are for accept. Acks already read count too, as they can free up credit for a frame
+// that was held back.
+static int f_server_wait_event(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+  int count = viewer_count(server), pending = server->pending.length / sizeof(SPendingConnection), watched = 0;
+  struct pollfd pfds[count * 2 + pending + 1];
+  for (int i = 0; i < count; ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    if (!duplex_check(&viewer->duplex))
+      continue;
+    uint32_t acked_frames = viewer->acked_frames;
+    if (viewer->event_offset < viewer->event_batch.length || viewer_next_packet(viewer, 0) || viewer->acked_frames != acked_frames) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    watched += duplex_poll_fds(&viewer->duplex, &pfds[watched]);
+  }
+  // anyone connecting, or sending the handshake for a connection that's waiting on it, wakes us too; see accept.
+  if (server->listening)
+    pfds[watched++] = (struct pollfd){ server->listening, POLLIN, 0 };
+  for (int i = 0; i < pending; ++i)
+    pfds[watched++] = (struct pollfd){ ((SPendingConnection*)server->pending.data)[i].fd, POLLIN, 0 };
+  lua_pushboolean(L, poll(pfds, watched, timeout < 0 ? -1 : (int)ceil(timeout * 1000)) > 0);
+  return 1;
+}
+
+static int f_server_poll_event(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  // viewers other than the input owner are read only so that their font requests get answered; the rest is dropped.
+  for (int i = 1; i < viewer_count(server); ++i) {
+    SViewer* viewer = get_viewer(server, i);
+    while (viewer_next_packet(viewer, 1)) {
+      if (viewer->duplex.incoming_packet_type == PACKET_FONT_REQUEST)
+        send_font_blob(L, server, viewer);
+      else if (viewer->duplex.incoming_packet_type == PACKET_EVENT_BATCH)
+        take_event_batch(viewer, &viewer->duplex.incoming_buffer);
+      array_clear(&viewer->duplex.incoming_buffer);
+      viewer->duplex.incoming_packet_type = PACKET_NONE;
+    }
+  }
+  SViewer* owner = viewer_count(server) ? get_viewer(server, 0) : NULL;
+  while (owner && owner->duplex.fd) {
+    if (owner->event_offset >= owner->event_batch.length) {
+      viewer_next_packet(owner, 1);
+      if (owner->duplex.incoming_packet_type == PACKET_EVENT_BATCH) {
+        if (!take_event_batch(owner, &owner->duplex.incoming_buffer)) {
+          owner->duplex.incoming_packet_type = PACKET_NONE;
+          duplex_close(&owner->duplex);
+          return luaL_error(L, "malformed event batch from %s", owner->address);
+        }
+        // keep the batch around, so the rest of it is handed out by the following calls without touching the socket.
+        array_t batch = owner->event_batch;
+        owner->event_batch = owner->duplex.incoming_buffer;
+        owner->duplex.incoming_buffer = batch;
+        array_clear(&owner->duplex.incoming_buffer);
+        owner->event_offset = 0;
+        owner->duplex.incoming_packet_type = PACKET_NONE;
+      } else if (owner->duplex.incoming_packet_type == PACKET_FONT_REQUEST) {
+        // answered here, and not handed out as an event.
+        send_font_blob(L, server, owner);
+        array_clear(&owner->duplex.incoming_buffer);
+        owner->duplex.incoming_packet_type = PACKET_NONE;
+        continue;
+      } else if (owner->duplex.incoming_packet_type != PACKET_NONE) {
+        int n = pull_lua(L, &owner->duplex.incoming_buffer);
+        array_clear(&owner->duplex.incoming_buffer);
+        owner->duplex.incoming_packet_type = PACKET_NONE;
+        return n;
+      }
+    }
+    if (owner->event_offset < owner->event_batch.length) {
+      int top = lua_gettop(L);
+      const char* ptr = owner->event_batch.data + owner->event_offset;
+      int n = read_event(L, &ptr, owner->event_batch.data + owner->event_batch.length);
+      if (n == -1) {
+        lua_settop(L, top);
+        array_clear(&owner->event_batch);
+        owner->event_offset = 0;
+        duplex_close(&owner->duplex);
+        return luaL_error(L, "malformed event batch from %s", owner->address);
+      }
+      owner->event_offset = ptr - owner->event_batch.data;
+      return n;
+    }
+    break;
+  }
+  // with everything read, whatever acks came in may have freed up credit for the frame end_frame held back.
+  if (server->deferred && check_viewers(server) && viewers_ready(server))
+    send_frame(server, get_time());
+  catch_up_viewers(server);
+  return 0;
+}
+
+
+static int f_server_send_event(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  push_lua(L, lua_gettop(L) - 1, &server->outgoing_buffer);
+  broadcast(server, PACKET_EVENT, &server->outgoing_buffer, 0);
+  return 0;
+}
+
+
+static int f_server_train_dictionary(lua_State* L) {
+  SServer* server = luaL_checkudata(L, 1, "remoteserver");
+  if (!viewer_count(server))
+    return luaL_error(L, "no client connected");
+  return train_dictionary(L, &get_viewer(server, 0)->duplex);
+}
+
+
+static const luaL_Reg server[] = {
+  { "__gc",          f_server_gc            },
+  { "begin_frame",   f_server_begin_frame   },
+  { "end_frame",     f_server_end_frame     },
+  { "set_clip_rect", f_server_set_clip_rect },
+  { "draw_rect",     f_server_draw_rect     },
+  { "draw_text",     f_server_draw_text     },
+  { "get_width",     f_server_get_width     },
+  { "set_caret",     f_server_set_caret     },
+  { "register_font", f_server_register_font },
+  { "accept",        f_server_accept        },
+  { "wait_event",    f_server_wait_event    },
+  { "poll_event",    f_server_poll_event    },
+  { "send_event",    f_server_send_event    },
+  { "is_open",       f_server_is_open       },
+  { "viewers",       f_server_viewers       },
+  { "set_input_owner", f_server_set_input_owner },
+  { "compression_level", f_server_compression_level },
+  { "stats",         f_server_stats         },
+  { "reset_stats",   f_server_reset_stats   },
+  { "record",        f_server_record        },
+  { "train_dictionary", f_server_train_dictionary },
+  { NULL,            NULL                   }
+};
+
+static void* waker_thread(void* data) {
+  SWaker* waker = data;
+  pthread_mutex_lock(&waker->mutex);
+  while (!waker->stopping) {
+    if (!waker->armed) {
+      pthread_cond_wait(&waker->cond, &waker->mutex);
+      continue;
+    }
+    struct pollfd pfds[4];
+    int count = waker->watched_count;
+    memcpy(pfds, waker->watched, sizeof(waker->watched));
+    pfds[count] = (struct pollfd){ waker->cancel[0], POLLIN, 0 };
+    pthread_mutex_unlock(&waker->mutex);
+    poll(pfds, count + 1, -1);
+    char drained[16];
+    while (read(waker->cancel[0], drained, sizeof(drained)) > 0) {}
+    pthread_mutex_lock(&waker->mutex);
+    int ready = 0;
+    for (int i = 0; i < count; ++i)
+      ready = ready || pfds[i].revents;
+    if (ready && waker->armed) {
+      // big enough for an SDL_Event of either SDL2 or SDL3.
+      union { uint32_t type; uint8_t padding[128]; } event;
+      memset(&event, 0, sizeof(event));
+      event.type = SDL_USER_EVENT;
+      waker->push_event(&event);
+      waker->armed = 0;
+    }
+  }
+  pthread_mutex_unlock(&waker->mutex);
+  return NULL;
+}
+
+// Starts the waker's thread, unless it's running already; returns -1 if it can't, as there's no SDL to wake.
+static int waker_start(SWaker* waker) {
+  if (!waker->started) {
+    #if _WIN32
+      void* push_event = NULL;
+    #else
+      void* host = dlopen(NULL, RTLD_LAZY);
+      void* push_event = host ? dlsym(host, "SDL_PushEvent") : NULL;
+    #endif
+    waker->started = -1;
+    if (!push_event || pipe(waker->cancel))
+      return -1;
+    fcntl(waker->cancel[0], F_SETFL, fcntl(waker->cancel[0], F_GETFL, 0) | O_NONBLOCK);
+    waker->push_event = (int (*)(void*))push_event;
+    pthread_mutex_init(&waker->mutex, NULL);
+    pthread_cond_init(&waker->cond, NULL);
+    if (pthread_create(&waker->thread, NULL, waker_thread, waker)) {
+      pthread_mutex_destroy(&waker->mutex);
+      pthread_cond_destroy(&waker->cond);
+      close(waker->cancel[0]);
+      close(waker->cancel[1]);
+      return -1;
+    }
+    waker->started = 1;
+  }
+  return waker->started == 1 ? 0 : -1;
+}
+
+static void waker_arm(SWaker* waker, struct pollfd* pfds, int count) {
+  pthread_mutex_lock(&waker->mutex);
+  memcpy(waker->watched, pfds, count * sizeof(struct pollfd));
+  waker->watched_count = count;
+  waker->armed = 1;
+  pthread_cond_signal(&waker->cond);
+  pthread_mutex_unlock(&waker->mutex);
+}
+
+static void waker_disarm(SWaker* waker) {
+  pthread_mutex_lock(&waker->mutex);
+  // still armed means the thread hasn't woken anyone, and may well be sitting in poll.
+  if (waker->armed && write(waker->cancel[1], "", 1)) {}
+  waker->armed = 0;
+  pthread_mutex_unlock(&waker->mutex);
+}
+
+static void waker_stop(SWaker* waker) {
+  if (waker->started != 1)
+    return;
+  pthread_mutex_lock(&waker->mutex);
+  waker->stopping = 1;
+  if (write(waker->cancel[1], "", 1)) {}
+  pthread_cond_signal(&waker->cond);
+  pthread_mutex_unlock(&waker->mutex);
+  pthread_join(waker->thread, NULL);
+  pthread_mutex_destroy(&waker->mutex);
+  pthread_cond_destroy(&waker->cond);
+  close(waker->cancel[0]);
+  close(waker->cancel[1]);
+  waker->started = 0;
+}
+
+// Connects to the server, presenting the session token from the previous connection if there was one; returns whether
+// the server took it, and so still has the session we were part of.
+static int client_connect(lua_State* L, SClient* client) {
+  int transport;
+  const char* path = local_socket_path(client->hostname, &transport);
+  const char* ip = "local";
+  if (path) {
+    struct sockaddr_un dest_addr = { .sun_family = AF_UNIX };
+    snprintf(dest_addr.sun_path, sizeof(dest_addr.sun_path), "%s", path);
+    client->duplex.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    set_socket_timeout(client->duplex.fd, HANDSHAKE_TIMEOUT);
+    if (connect(client->duplex.fd, (struct sockaddr *) &dest_addr, sizeof(dest_addr)) == -1) {
+      close(client->duplex.fd);
+      client->duplex.fd = 0;
+      return luaL_error(L, "can't connect to %s: %s", path, strerror(errno));
+    }
+  } else {
+    struct hostent *host = gethostbyname(client->hostname);
+    if (!host)
+      return luaL_error(L, "can't resolve host %s", client->hostname);
+    struct sockaddr_in dest_addr = {0};
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(client->port);
+    dest_addr.sin_addr.s_addr = *(long*)(host->h_addr);
+    ip = inet_ntoa(dest_addr.sin_addr);
+    client->duplex.fd = socket(AF_INET, SOCK_STREAM, 0);
+    // bounds the connect, as well as the handshake, so that reconnecting can't hang the editor for long.
+    set_socket_timeout(client->duplex.fd, HANDSHAKE_TIMEOUT);
+    if (connect(client->duplex.fd, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr)) == -1 ) {
+      close(client->duplex.fd);
+      client->duplex.fd = 0;
+      return luaL_error(L, "can't connect to host %s [%s] on port %d", client->hostname, ip, client->port);
+    }
+  }
+  SHandshake handshake = { .window_log = client->window_log, .string_table_size = client->string_table_size, .transport = transport, .fonts = client->font_registrations };
+  memcpy(handshake.token, client->token, SESSION_TOKEN_SIZE);
+  if (duplex_handshake(&client->duplex, &handshake, &client->dictionary, 0)) {
+    duplex_close(&client->duplex);
+    return luaL_error(L, "can't handshake with host %s [%s] on port %d", client->hostname, ip, client->port);
+  }
+  set_socket_timeout(client->duplex.fd, 0);
+  int resumed = memcmp(handshake.token, client->token, SESSION_TOKEN_SIZE) == 0;
+  memcpy(client->token, handshake.token, SESSION_TOKEN_SIZE);
+  client->duplex.trace = &client->trace;
+  client->duplex.connection = client->connections++;
+  string_table_free(&client->strings);
+  string_table_init(&client->strings, handshake.string_table_size);
+  int flags = fcntl(client->duplex.fd, F_GETFL, 0);
+  fcntl(client->duplex.fd, F_SETFL, flags | O_NONBLOCK);
+  return resumed;
+}
+
+static int f_client_gc(lua_State* L) {
+  SClient* client = lua_touserdata(L, 1);
+  waker_stop(&client->waker);
+  duplex_free(&client->duplex);
+  rencache_free(&client->rencache);
+  rencache_free(&client->next_rencache);
+  free(client->font_heights.data);
+  free(client->dirty_rects.data);
+  free(client->copy_rects.data);
+  free(client->predicted.data);
+  free(client->predicted_sequences.data);
+  string_table_free(&client->strings);
+  free(client->event_batch.data);
+  free(client->dictionary.data);
+  trace_close(&client->trace);
+  return 0;
+}
+
+// Returns the frames received, commands per frame and the time spent decoding and drawing them, and what's been sent
+// and received of each type of packet, across reconnects. Times are as in server:stats().
+static int f_client_stats(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  lua_newtable(L);
+  push_frame_stats(L, &client->stats, "replay_time");
+  push_duplex_stats(L, &client->duplex);
+  return 1;
+}
+
+// As server:record(); frames received before the next keyframe can't be decoded from the trace, as they're deltas.
+static int f_client_record(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  const char* path = luaL_optstring(L, 2, NULL);
+  if (!path) {
+    trace_close(&client->trace);
+    return 0;
+  }
+  if (trace_open(&client->trace, path, TRACE_CLIENT))
+    return luaL_error(L, "can't record to %s: %s", path, strerror(errno));
+  return 0;
+}
+
+static int f_client_reset_stats(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  memset(&client->stats, 0, sizeof(client->stats));
+  duplex_reset_stats(&client->duplex);
+  return 0;
+}
+
+// Returns the level the given type of packet is currently compressed at; with a level, fixes it at that, and with
+// `false`, lets it adapt again.
+static int f_client_compression_level(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  EPacketType type;
+  int value, fixed;
+  if (check_compression_level(L, &type, &value, &fixed))
+    duplex_set_compression_level(&client->duplex, type, value, fixed);
+  lua_pushinteger(L, duplex_compression_level(&client->duplex, type));
+  return 1;
+}
+
+static int f_client_is_open(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  lua_pushboolean(L, duplex_check(&client->duplex));
+  return 1;
+}
+
+// Connects to the same server again, after the connection dropped; returns whether our session was resumed. If it was,
+// the fonts we have carry over, and the server catches us up with a keyframe; if not, everything's sent again.
+static int f_client_reconnect(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  // what's been learnt about the link carries over, as do the stats.
+  SDuplex settings = client->duplex;
+  duplex_free(&client->duplex);
+  memset(&client->duplex, 0, sizeof(SDuplex));
+  client->duplex.capture_samples = settings.capture_samples;
+  memcpy(client->duplex.levels, settings.levels, sizeof(settings.levels));
+  client->duplex.adaptive = settings.adaptive;
+  memcpy(client->duplex.sent_stats, settings.sent_stats, sizeof(settings.sent_stats));
+  memcpy(client->duplex.received_stats, settings.received_stats, sizeof(settings.received_stats));
+  client->duplex.send_latency = settings.send_latency;
+  rencache_clear(&client->rencache);
+  rencache_clear(&client->next_rencache);
+  client->redraw_all = 1;
+  array_clear(&client->event_batch);
+  client->coalesced.name = -1;
+  // the new connection's frames count our input from scratch.
+  client->input_sequence = client->acked_sequence = client->suspend_sequence = client->received_frames = 0;
+  client->has_caret = 0;
+  array_clear(&client->predicted);
+  array_clear(&client->predicted_sequences);
+  client->echo_rect = (RenRect){ 0, 0, 0, 0 };
+  int resumed = client_connect(L, client);
+  if (!resumed) {
+    client->font_registrations = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, client->font_table);
+    lua_newtable(L);
+    client->font_table = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_unref(L, LUA_REGISTRYINDEX, client->pending_fonts);
+    lua_newtable(L);
+    client->pending_fonts = luaL_ref(L, LUA_REGISTRYINDEX);
+    array_clear(&client->font_heights);
+  } else {
+    // whatever we asked for on the old connection went unanswered.
+    lua_rawgeti(L, LUA_REGISTRYINDEX, client->pending_fonts);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pushvalue(L, -2);
+      push_lua(L, 1, &client->duplex.outgoing_buffer);
+      send_compressed_buffer(&client->duplex, PACKET_FONT_REQUEST, &client->duplex.outgoing_buffer);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushboolean(L, resumed);
+  return 1;
+}
+
+// Keeps local echo in step with an event that's about to be sent: text input is predicted, and anything else that
+// could change where it goes stops us predicting until the server's processed it. Mouse motion, and the keys that come
+// with text input, don't.
+static void predict_input(lua_State* L, SClient* client, int name) {
+  const char* event = name != -1 ? event_names[name] : "";
+  uint32_t sequence = client->input_sequence + 1;
+  if (!client->local_echo)
+    return;
+  if (strcmp(event, "textinput") == 0 && lua_type(L, 3) == LUA_TSTRING) {
+    size_t length;
+    const char* text = lua_tolstring(L, 3, &length);
+    if (client->has_caret && (int32_t)(client->acked_sequence - client->suspend_sequence) >= 0 && client->predicted.length + length <= MAX_PREDICTED_LENGTH) {
+      if (!client->predicted.length)
+        client->predicted_time = get_time();
+      array_append(&client->predicted, text, length);
+      for (size_t i = 0; i < length; ++i)
+        array_append(&client->predicted_sequences, &sequence, sizeof(sequence));
+      client->echo_pending = 1;
+      return;
+    }
+  } else if (strcmp(event, "mousemoved") == 0 || strcmp(event, "keyreleased") == 0)
+    return;
+  else if (strcmp(event, "keypressed") == 0 && lua_type(L, 3) == LUA_TSTRING) {
+    const char* key = lua_tostring(L, 3);
+    if (strlen(key) == 1 || strcmp(key, "space") == 0 || strstr(key, "shift"))
+      return;
+  }
+  client->suspend_sequence = sequence;
+}
+
+// Queues an event for the next flush_events; runs of mouse motion or wheel events are folded into one.
+static int f_client_send_event(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  int count = lua_gettop(L) - 1;
+  int name = lua_type(L, 2) == LUA_TSTRING ? find_event_name(lua_tostring(L, 2)) : -1;
+  int motion = name != -1 && strcmp(event_names[name], "mousemoved") == 0;
+  int coalescable = name != -1 && (motion || strcmp(event_names[name], "mousewheel") == 0) && count - 1 <= MAX_COALESCED_ARGUMENTS;
+  for (int i = 3; coalescable && i <= count + 1; ++i)
+    coalescable = lua_type(L, i) == LUA_TNUMBER;
+  SCoalescedEvent* pending = &client->coalesced;
+  predict_input(L, client, name);
+  if (pending->name != -1 && (!coalescable || pending->name != name || pending->count != count - 1)) {
+    write_coalesced_event(pending, &client->event_batch);
+    pending->name = -1;
+  }
+  if (coalescable) {
+    for (int i = 0; i < count - 1; ++i) {
+      lua_Number value = lua_tonumber(L, i + 3);
+      // motion events carry the absolute position first, then the relative movement; everything else accumulates.
+      if (pending->name == -1 || (motion && i < 2))
+        pending->values[i] = value;
+      else
+        pending->values[i] += value;
+      pending->integer[i] = lua_isinteger(L, i + 3) && (pending->name == -1 || pending->integer[i]);
+    }
+    pending->name = name;
+    pending->count = count - 1;
+  } else if (count > 0)
+    write_event(L, 2, count, &client->event_batch);
   return 0;
 }
 
-static int f_server_draw_rect(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  lua_Number x = luaL_checknumber(L, 2);
-  lua_Number y = luaL_checknumber(L, 3);
-  lua_Number w = luaL_checknumber(L, 4);
-  lua_Number h = luaL_checknumber(L, 5);
-  DrawRectCommand cmd = { { DRAW_RECT, sizeof(DrawRectCommand) }, rect_to_grid(x, y, w, h), checkcolor(L, 6, 255) };
-  push_command(&server->rencache, &cmd.command);
+static int f_client_flush_events(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  if (client->coalesced.name != -1) {
+    write_coalesced_event(&client->coalesced, &client->event_batch);
+    client->coalesced.name = -1;
+  }
+  if (client->event_batch.length > 0 && client->duplex.fd) {
+    // the server owes us an ack for text we predicted, even if it doesn't change what's drawn.
+    size_t predicted = client->predicted_sequences.length / sizeof(uint32_t);
+    uint8_t flags = predicted && ((uint32_t*)client->predicted_sequences.data)[predicted - 1] == client->input_sequence + 1 ? BATCH_PREDICTED : 0;
+    array_append(&client->event_batch, &flags, 1);
+    send_compressed_buffer(&client->duplex, PACKET_EVENT_BATCH, &client->event_batch);
+    ++client->input_sequence;
+  }
+  array_clear(&client->event_batch);
   return 0;
 }
 
-static int f_server_draw_text(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  if (server->duplex.fd) {
-    int fonts[FONT_FALLBACK_MAX];
-    if (lua_type(L, 1) != LUA_TTABLE) {
-      struct RenFont* font = *(struct RenFont**)lua_touserdata(L, 2);
-      fonts[0] = get_font_index(server, font);
-      if (fonts[0] == -1)
-        return luaL_error(L, "can't find unregistered font");
-    } else {
-      int len = luaL_len(L, 1); len = len > FONT_FALLBACK_MAX ? FONT_FALLBACK_MAX : len;
-      for (int i = 0; i < len; i++) {
-        lua_rawgeti(L, 1, i+1);
-        struct RenFont* font = *(struct RenFont**)lua_touserdata(L, -1);
-        fonts[i] = get_font_index(server, font);
-        if (fonts[i] == -1)
-          return luaL_error(L, "can't find unregistered font");
-        lua_pop(L, 1);
-      }
-    }
-    size_t len;
-    const char *text = luaL_checklstring(L, 3, &len);
-    double x = luaL_checknumber(L, 4);
-    int y = luaL_checknumber(L, 5);
-    RenColor color = checkcolor(L, 6, 255);
-    static array_t cmd_array = {0};
-    array_reserve(&cmd_array, sizeof(DrawTextCommand) + len);
-    DrawTextCommand* cmd = (DrawTextCommand*)cmd_array.data;
-    *cmd = (DrawTextCommand){ { .type = DRAW_TEXT, .size = sizeof(DrawTextCommand) + len }, .color = color, .fonts = *fonts, .text_x = x, .y = y, .len = len, .tab_size = 2 };
-    memcpy(&cmd->text, text, len);
-    push_command(&server->rencache, (Command*)cmd);
-  }
-  return 0;
+static void lua_pushcolor(lua_State* L, RenColor color) {
+  lua_createtable(L, 4, 0);
+  lua_pushinteger(L, color.r);
+  lua_rawseti(L, -2, 1);
+  lua_pushinteger(L, color.g);
+  lua_rawseti(L, -2, 2);
+  lua_pushinteger(L, color.b);
+  lua_rawseti(L, -2, 3);
+  lua_pushinteger(L, color.a);
+  lua_rawseti(L, -2, 4);
 }
 
+static int client_has_packet(SClient* client) {
+  if (client->duplex.incoming_packet_type == PACKET_NONE && client->duplex.fd)
+    recv_compressed_buffer(&client->duplex);
+  return client->duplex.incoming_packet_type != PACKET_NONE;
+}
 
-static int f_server_accept(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  
-  struct sockaddr_in peer_addr = {0};
-  socklen_t peer_size = sizeof(peer_addr);
-  server->duplex.fd = accept(server->listening, (struct sockaddr*)&peer_addr, &peer_size);
-  if (server->duplex.fd == -1)
-    return luaL_error(L, "can't accept: %s", strerror(errno));
-  close(server->listening);
-  server->listening = 0;
-  int flags = fcntl(server->duplex.fd, F_GETFL, 0);
-  fcntl(server->duplex.fd, F_SETFL, flags | O_NONBLOCK);
-  lua_pushstring(L, inet_ntoa(peer_addr.sin_addr));
+static int f_client_has_event(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  lua_pushboolean(L, client_has_packet(client));
   return 1;
 }
 
+// Calls `wait_event` at 3, the renderer's own system.wait_event, with the given timeout; returns what it does.
+static int call_wait_event(lua_State* L, int timeout) {
+  lua_pushvalue(L, 3);
+  lua_pushvalue(L, timeout);
+  lua_call(L, 1, 1);
+  int had_event = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return had_event;
+}
 
-static int f_server_is_open(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  lua_pushboolean(L, server->duplex.fd != 0);
+// Waits for either something from the server, or one of the window's own events, which the renderer's
+// system.wait_event, passed as `wait_event`, waits for; for up to `timeout` seconds, or for good without one. Returns
+// whether there's either. Without SDL to wake, it takes turns at both, WAIT_SLICE seconds at a time.
+static int f_client_wait_event(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  lua_Number timeout = luaL_optnumber(L, 2, -1);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  if (client_has_packet(client)) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  struct pollfd pfds[2];
+  int count = client->duplex.fd ? duplex_poll_fds(&client->duplex, pfds) : 0;
+  if (!count || !waker_start(&client->waker)) {
+    if (count)
+      waker_arm(&client->waker, pfds, count);
+    int had_event = call_wait_event(L, 2);
+    if (count)
+      waker_disarm(&client->waker);
+    lua_pushboolean(L, had_event || client_has_packet(client));
+    return 1;
+  }
+  uint64_t deadline = timeout < 0 ? UINT64_MAX : get_time() + (uint64_t)(timeout * 1e9);
+  do {
+    uint64_t now = get_time();
+    lua_pushnumber(L, deadline - now < WAIT_SLICE * 1e9 ? (deadline - now) / 1e9 : WAIT_SLICE);
+    if (call_wait_event(L, 4) || (poll(pfds, count, 0) > 0 && client_has_packet(client))) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    lua_pop(L, 1);
+  } while (get_time() < deadline);
+  lua_pushboolean(L, 0);
   return 1;
 }
 
+// Pushes a color table, reusing the one made the last time this color was drawn; the renderer never modifies them.
+static void push_cached_color(lua_State* L, SClient* client, int color_table, RenColor color) {
+  lua_Integer key = ((lua_Integer)color.r << 24) | (color.g << 16) | (color.b << 8) | color.a;
+  if (lua_rawgeti(L, color_table, key) == LUA_TNIL) {
+    lua_pop(L, 1);
+    lua_pushcolor(L, color);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, color_table, key);
+    ++client->cached_colors;
+  }
+}
 
-static int f_server_wait_event(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  if (server->duplex.fd) {
-    lua_pushboolean(L, server->duplex.incoming_packet_type != PACKET_NONE || recv_compressed_buffer(&server->duplex));
-    return 1; 
+static void call_set_clip(lua_State* L, RenRect rect) {
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, rect.x);
+  lua_pushinteger(L, rect.y);
+  lua_pushinteger(L, rect.width);
+  lua_pushinteger(L, rect.height);
+  lua_call(L, 4, 0);
+}
+
+// Pushes what `text` is drawn in: its font, or if it has fallbacks, a group of it and whichever of those are loaded.
+// Returns LUA_TNIL if its own font isn't.
+static int push_text_font(lua_State* L, DrawTextCommand* text, int font_table) {
+  if (lua_rawgeti(L, font_table, text->fonts[0]) == LUA_TNIL || !text->fonts[1])
+    return lua_type(L, -1);
+  lua_createtable(L, FONT_FALLBACK_MAX, 0);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, 1);
+  for (int i = 1, n = 2; i < FONT_FALLBACK_MAX && text->fonts[i]; ++i) {
+    if (lua_rawgeti(L, font_table, text->fonts[i]) == LUA_TNIL)
+      lua_pop(L, 1);
+    else
+      lua_rawseti(L, -2, n++);
   }
-  return 0;
+  return LUA_TTABLE;
 }
 
-static int f_server_poll_event(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  if (server->duplex.fd) {
-    if (server->duplex.incoming_packet_type == PACKET_NONE)
-      recv_compressed_buffer(&server->duplex);
-    if (server->duplex.incoming_packet_type != PACKET_NONE) {
-      int n = pull_lua(L, &server->duplex.incoming_buffer);
-      array_clear(&server->duplex.incoming_buffer);
-      server->duplex.incoming_packet_type = PACKET_NONE;
-      return n;
+// Replays the current frame through the renderer callbacks at 2, 3 and 4. If `bounds` is given, only what
+// falls inside it is drawn, and every clip rect is narrowed to it, so nothing outside is touched. With a `shift`, text
+// is drawn that much further right, and no further left than that inside `bounds`, and the caret isn't drawn; which
+// makes room at the left of `bounds` for local echo. `font_table` and `color_table` are the stack indices of the font
+// and color tables, which are looked up once per frame.
+static void replay_commands(lua_State* L, SClient* client, RenRect* bounds, int shift, int font_table, int color_table) {
+  RenRect clip_rect = bounds ? *bounds : unclipped_rect, last_clip_rect = { -1, -1, -1, -1 };
+  for (size_t i = 0; i < rencache_length(&client->rencache); ++i) {
+    Command* command = rencache_command(&client->rencache, i);
+    if (command->type == SET_CLIP) {
+      clip_rect = bounds ? intersect_rects(((SetClipCommand*)command)->rect, *bounds) : ((SetClipCommand*)command)->rect;
+      continue;
+    }
+    RenRect draw_clip = clip_rect;
+    int dx = 0;
+    if (shift && command->type == DRAW_TEXT) {
+      draw_clip = intersect_rects(clip_rect, (RenRect){ bounds->x + shift, bounds->y, bounds->width, bounds->height });
+      dx = shift;
+    } else if (shift && command->type == DRAW_RECT && memcmp(&((DrawRectCommand*)command)->rect, &client->caret.rect, sizeof(RenRect)) == 0)
+      continue;
+    if (bounds) {
+      RenRect rect = command_rect(&client->font_heights, command, (RenRect){ draw_clip.x - dx, draw_clip.y, draw_clip.width, draw_clip.height });
+      if (rect.width <= 0 || rect.height <= 0)
+        continue;
+    }
+    // clip changes are only made when something is drawn under them, and only if they actually change anything.
+    if (memcmp(&draw_clip, &last_clip_rect, sizeof(RenRect))) {
+      call_set_clip(L, draw_clip);
+      last_clip_rect = draw_clip;
+    }
+    switch (command->type) {
+      case DRAW_RECT: {
+        DrawRectCommand* rect = (DrawRectCommand*)command;
+        lua_pushvalue(L, 3);
+        lua_pushinteger(L, rect->rect.x);
+        lua_pushinteger(L, rect->rect.y);
+        lua_pushinteger(L, rect->rect.width);
+        lua_pushinteger(L, rect->rect.height);
+        push_cached_color(L, client, color_table, rect->color);
+        lua_call(L, 5, 0);
+      } break;
+      case DRAW_TEXT: {
+        DrawTextCommand* text = (DrawTextCommand*)command;
+        if (push_text_font(L, text, font_table) == LUA_TNIL) {
+          lua_pop(L, 1);
+          break;
+        }
+        lua_pushvalue(L, 4);
+        lua_insert(L, -2);
+        lua_pushlstring(L, text->text, text->len);
+        lua_pushnumber(L, text->text_x + dx);
+        lua_pushnumber(L, text->y);
+        push_cached_color(L, client, color_table, text->color);
+        lua_call(L, 5, 0);
+      } break;
+      default: break;
     }
   }
-  return 0;
 }
 
+// Moves what's on screen by calling copy_rect(x, y, w, h, dy) at 7 for each of the frame's copy rects.
+static void call_copy_rect(lua_State* L, SCopyRect* copy) {
+  lua_pushvalue(L, 7);
+  lua_pushinteger(L, copy->rect.x);
+  lua_pushinteger(L, copy->rect.y);
+  lua_pushinteger(L, copy->rect.width);
+  lua_pushinteger(L, copy->rect.height);
+  lua_pushinteger(L, copy->dy);
+  lua_call(L, 5, 0);
+}
 
-static int f_server_send_event(lua_State* L) {
-  SServer* server = luaL_checkudata(L, 1, "remoteserver");
-  push_lua(L, lua_gettop(L) - 1, &server->duplex.outgoing_buffer);
-  send_compressed_buffer(&server->duplex, PACKET_EVENT, &server->duplex.outgoing_buffer);
-  return 0;
+// Calls begin_frame, and pushes the font and color tables; returns the stack index of the font table, which the color
+// table follows.
+static int begin_replay(lua_State* L, SClient* client) {
+  if (lua_isfunction(L, 6)) {
+    lua_pushvalue(L, 6);
+    lua_call(L, 0, 0);
+  }
+  if (client->cached_colors > MAX_CACHED_COLORS) {
+    luaL_unref(L, LUA_REGISTRYINDEX, client->color_table);
+    lua_newtable(L);
+    client->color_table = luaL_ref(L, LUA_REGISTRYINDEX);
+    client->cached_colors = 0;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, client->font_table);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, client->color_table);
+  return lua_gettop(L) - 1;
 }
 
+// Draws the text typed since the last frame at that frame's caret, with the rest of the caret's line moved right to
+// make room for it, and the caret after it.
+static void draw_prediction(lua_State* L, SClient* client, int font_table, int color_table) {
+  SCaret* caret = &client->caret;
+  RenRect line = intersect_rects(caret->clip, (RenRect){ caret->rect.x, caret->rect.y, caret->clip.x + caret->clip.width - caret->rect.x, caret->rect.height });
+  client->echo_pending = 0;
+  if (line.width <= 0 || line.height <= 0)
+    return;
+  if (lua_rawgeti(L, font_table, caret->font) == LUA_TNIL) {
+    lua_pop(L, 1);
+    return;
+  }
+  int font = lua_gettop(L);
+  int width = ceil(call_font_width(L, font, client->predicted.data, client->predicted.length));
+  replay_commands(L, client, &line, width, font_table, color_table);
+  call_set_clip(L, line);
+  lua_pushvalue(L, 4);
+  lua_pushvalue(L, font);
+  lua_pushlstring(L, client->predicted.data, client->predicted.length);
+  lua_pushnumber(L, caret->rect.x);
+  lua_pushnumber(L, caret->rect.y + (caret->rect.height - get_font_height(&client->font_heights, caret->font)) / 2);
+  push_cached_color(L, client, color_table, caret->text_color);
+  lua_call(L, 5, 0);
+  lua_pushvalue(L, 3);
+  lua_pushinteger(L, caret->rect.x + width);
+  lua_pushinteger(L, caret->rect.y);
+  lua_pushinteger(L, caret->rect.width);
+  lua_pushinteger(L, caret->rect.height);
+  push_cached_color(L, client, color_table, caret->caret_color);
+  lua_call(L, 5, 0);
+  lua_pop(L, 1);
+  client->echo_rect = line;
+}
 
-static const luaL_Reg server[] = {
-  { "__gc",          f_server_gc            },
-  { "begin_frame",   f_server_begin_frame   },
-  { "end_frame",     f_server_end_frame     },
-  { "set_clip_rect", f_server_set_clip_rect },
-  { "draw_rect",     f_server_draw_rect     },
-  { "draw_text",     f_server_draw_text     },
-  { "register_font", f_server_register_font },
-  { "accept",        f_server_accept        },
-  { "wait_event",    f_server_wait_event    },
-  { "poll_event",    f_server_poll_event    },
-  { "send_event",    f_server_send_event    },
-  { "is_open",       f_server_is_open       },
-  { NULL,            NULL                   }
-};
+// Forgets what was predicted of the event batches the server's processed, as frames show what they did now; or all
+// of it.
+static void drop_predicted(SClient* client, int all) {
+  uint32_t* sequences = (uint32_t*)client->predicted_sequences.data;
+  size_t count = 0;
+  while (count < client->predicted.length && (all || (int32_t)(sequences[count] - client->acked_sequence) <= 0))
+    ++count;
+  array_shift(&client->predicted, count);
+  array_shift(&client->predicted_sequences, count * sizeof(uint32_t));
+  if (count && client->predicted.length)
+    client->predicted_time = get_time();
+  client->echo_pending = client->predicted.length > 0;
+}
 
-static int f_client_gc(lua_State* L) {
-  SClient* client = lua_touserdata(L, 1);
-  close(client->duplex.fd);
-  free(client->duplex.incoming_buffer.data);
-  free(client->duplex.incoming_compressed_buffer.data);
-  free(client->duplex.outgoing_buffer.data);
-  free(client->duplex.outgoing_compressed_buffer.data);
+// Takes a newly decoded frame's word for what's been typed: what it shows is dropped from the prediction, and what
+// the prediction was drawn over is redrawn. Whatever's still predicted is drawn again at the frame's caret.
+static void reconcile_prediction(SClient* client, SFrameHeader* header) {
+  // input acks jump ahead of frames, so one sent before an ack can arrive after it.
+  if ((int32_t)(header->input_sequence - client->acked_sequence) > 0)
+    client->acked_sequence = header->input_sequence;
+  client->has_caret = (header->flags & FRAME_CARET) != 0;
+  drop_predicted(client, !client->has_caret || get_time() - client->predicted_time > PREDICTION_TIMEOUT);
+  if (client->echo_rect.width) {
+    // copies would move the prediction along with everything around it.
+    if (client->copy_rects.length)
+      client->redraw_all = 1;
+    else
+      array_append(&client->dirty_rects, &client->echo_rect, sizeof(RenRect));
+    client->echo_rect = (RenRect){ 0, 0, 0, 0 };
+  }
 }
 
-static int f_client_is_open(lua_State* L) {
-  SClient* client = luaL_checkudata(L, 1, "remoteclient");
-  lua_pushboolean(L, client->duplex.fd != 0);
-  return 1;
+// Takes the server's word that it's processed input it didn't draw anything for: what was predicted of it is dropped,
+// and drawn over.
+static void acknowledge_input(lua_State* L, SClient* client, uint32_t sequence) {
+  size_t predicted = client->predicted.length;
+  if ((int32_t)(sequence - client->acked_sequence) > 0)
+    client->acked_sequence = sequence;
+  drop_predicted(client, 0);
+  if (client->predicted.length == predicted || !client->echo_rect.width)
+    return;
+  int font_table = begin_replay(L, client);
+  // whatever's still predicted covers the same line as before.
+  if (client->predicted.length)
+    draw_prediction(L, client, font_table, font_table + 1);
+  else {
+    replay_commands(L, client, &client->echo_rect, 0, font_table, font_table + 1);
+    client->echo_rect = (RenRect){ 0, 0, 0, 0 };
+  }
+  lua_pop(L, 2);
 }
 
-static int f_client_send_event(lua_State* L) {
-  SClient* client = luaL_checkudata(L, 1, "remoteclient");
-  push_lua(L, lua_gettop(L) - 1, &client->duplex.outgoing_buffer);
-  send_compressed_buffer(&client->duplex, PACKET_EVENT, &client->duplex.outgoing_buffer);
-  return 0;
+// Between frames: draws what's been typed since the last one, or, if the server's taking too long to show it, takes
+// it back, and predicts nothing more until the server's caught up.
+static void echo_typing(lua_State* L, SClient* client) {
+  int expired = client->predicted.length && get_time() - client->predicted_time > PREDICTION_TIMEOUT;
+  if (!expired && (!client->echo_pending || !client->has_caret))
+    return;
+  int font_table = begin_replay(L, client);
+  if (expired) {
+    drop_predicted(client, 1);
+    client->suspend_sequence = client->input_sequence + 1;
+    if (client->echo_rect.width)
+      replay_commands(L, client, &client->echo_rect, 0, font_table, font_table + 1);
+    client->echo_rect = (RenRect){ 0, 0, 0, 0 };
+  } else
+    draw_prediction(L, client, font_table, font_table + 1);
+  lua_pop(L, 2);
 }
 
-static void lua_pushcolor(lua_State* L, RenColor color) {
-  lua_newtable(L);
-  lua_pushinteger(L, color.r);
-  lua_rawseti(L, -2, 1);
-  lua_pushinteger(L, color.g);
-  lua_rawseti(L, -2, 2);
-  lua_pushinteger(L, color.b);
-  lua_rawseti(L, -2, 3);
-  lua_pushinteger(L, color.a);
-  lua_rawseti(L, -2, 4);
+// Starts a frame and replays the current commands onto it; either everything, or just the last frame's dirty rects,
+// after making its copies. Without a copy_rect callback, whatever the copies would have moved is redrawn instead.
+static void replay_frame(lua_State* L, SClient* client, int redraw_all) {
+  int font_table = begin_replay(L, client), color_table = font_table + 1;
+  if (redraw_all || client->redraw_all) {
+    replay_commands(L, client, NULL, 0, font_table, color_table);
+    client->redraw_all = 0;
+  } else {
+    SCopyRect* copies = (SCopyRect*)client->copy_rects.data;
+    size_t copy_count = client->copy_rects.length / sizeof(SCopyRect);
+    int copying = lua_isfunction(L, 7);
+    for (size_t i = 0; i < copy_count; ++i) {
+      if (copying)
+        call_copy_rect(L, &copies[i]);
+      else
+        replay_commands(L, client, &copies[i].rect, 0, font_table, color_table);
+    }
+    for (size_t i = 0; i < client->dirty_rects.length / sizeof(RenRect); ++i) {
+      RenRect* rect = &((RenRect*)client->dirty_rects.data)[i];
+      size_t k = 0;
+      while (!copying && k < copy_count && !rect_contains(copies[k].rect, *rect))
+        ++k;
+      if (copying || k == copy_count)
+        replay_commands(L, client, rect, 0, font_table, color_table);
+    }
+  }
+  if (client->predicted.length && client->has_caret)
+    draw_prediction(L, client, font_table, color_table);
+  array_clear(&client->copy_rects);
+  lua_pop(L, 2);
 }
 
-static int f_client_has_event(lua_State* L) {
-  SClient* client = luaL_checkudata(L, 1, "remoteclient");
-  if (client->duplex.incoming_packet_type == PACKET_NONE && client->duplex.fd)
-    recv_compressed_buffer(&client->duplex);
-  lua_pushboolean(L, client->duplex.incoming_packet_type != PACKET_NONE);
-  if (client->duplex.incoming_packet_type != PACKET_NONE) {
-    FILE* file = fopen("/tmp/wat", "wb");
-    fwrite(client->duplex.incoming_buffer.data, sizeof(char), client->duplex.incoming_buffer.length, file);
-    fclose(file);
+// Decodes a PACKET_COMMAND_BUFFER or PACKET_COMMAND_DELTA into `current`; a delta is applied to `previous`, which is
+// the frame decoded before. The caret goes into `caret`, if the frame has one. Returns -1 if the packet is malformed.
+static int decode_frame(SCommandCodec* codec, SStringTable* strings, SRencache* previous, SRencache* current, array_t* dirty_rects, array_t* copy_rects, SCaret* caret, EPacketType type, array_t* packet, SFrameHeader* header) {
+  if (packet->length < sizeof(SFrameHeader))
+    return -1;
+  memcpy(header, packet->data, sizeof(SFrameHeader));
+  if (header->dirty_count > MAX_DIRTY_RECTS || header->copy_count > MAX_COPY_RECTS)
+    return -1;
+  size_t dirty_length = header->dirty_count * sizeof(RenRect), copy_length = header->copy_count * sizeof(SCopyRect);
+  size_t caret_length = (header->flags & FRAME_CARET) ? sizeof(SCaret) : 0;
+  size_t header_length = sizeof(SFrameHeader) + dirty_length + copy_length + caret_length + ((header->flags & FRAME_RESET) ? sizeof(uint32_t) : 0);
+  uint32_t state_length = 0;
+  if (header->flags & FRAME_SYNC) {
+    if (type != PACKET_COMMAND_BUFFER || packet->length < header_length + sizeof(uint32_t))
+      return -1;
+    memcpy(&state_length, &packet->data[header_length], sizeof(uint32_t));
+    header_length += sizeof(uint32_t);
+    if (state_length > packet->length - header_length)
+      return -1;
+    header_length += state_length;
+  }
+  if (packet->length < header_length)
+    return -1;
+  array_clear(dirty_rects);
+  array_append(dirty_rects, &packet->data[sizeof(SFrameHeader)], dirty_length);
+  array_clear(copy_rects);
+  array_append(copy_rects, &packet->data[sizeof(SFrameHeader) + dirty_length], copy_length);
+  if (caret_length && caret)
+    memcpy(caret, &packet->data[sizeof(SFrameHeader) + dirty_length + copy_length], sizeof(SCaret));
+  if (header->flags & FRAME_RESET) {
+    uint32_t string_table_size;
+    memcpy(&string_table_size, &packet->data[header_length - sizeof(uint32_t)], sizeof(uint32_t));
+    string_table_free(strings);
+    string_table_init(strings, string_table_size);
+    memset(codec->palette, 0, sizeof(codec->palette));
+  }
+  SCommandReader reader;
+  if (begin_reading_commands(codec, &reader, &packet->data[header_length], packet->length - header_length, header->flags & FRAME_COLUMNAR))
+    return -1;
+  if (type == PACKET_COMMAND_DELTA)
+    return apply_delta(codec, strings, previous, &reader, current);
+  if (!(header->flags & FRAME_SYNC))
+    return decode_commands(codec, strings, &reader, current);
+  // written against an empty palette, and without the string table, which are only taken over after.
+  SStringTable unshared = {0};
+  memset(codec->palette, 0, sizeof(codec->palette));
+  if (decode_commands(codec, &unshared, &reader, current))
+    return -1;
+  return read_shared_state(codec, strings, &packet->data[header_length - state_length], state_length);
+}
+
+// Calls font_load with the description of a font { path, hash, idx, size, options }, and its contents if they've just
+// been received; returns whether it could be loaded, which it can't if the contents aren't in the cache.
+// Whether the value at `idx` looks like a hash the server made in register_font. Fonts are cached under their hash, so
+// anything else, like a path, is never let through to font_load.
+static int valid_font_hash(lua_State* L, int idx) {
+  size_t length;
+  const char* hash = lua_type(L, idx) == LUA_TSTRING ? lua_tolstring(L, idx, &length) : NULL;
+  if (!hash || length != FONT_HASH_LENGTH)
+    return 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (!(hash[i] >= '0' && hash[i] <= '9') && !(hash[i] >= 'a' && hash[i] <= 'f'))
+      return 0;
+  }
+  return 1;
+}
+
+// Returns 1 if the font's loaded, 0 if font_load needs its contents first, and -1 if the server sent a bad hash.
+static int load_font(lua_State* L, SClient* client, int description, int contents) {
+  lua_rawgeti(L, description, 2);
+  int valid = valid_font_hash(L, -1);
+  lua_pop(L, 1);
+  if (!valid)
+    return -1;
+  lua_pushvalue(L, 5);
+  for (int i = 1; i <= 5; ++i)
+    lua_rawgeti(L, description, i);
+  if (contents)
+    lua_pushvalue(L, contents);
+  else
+    lua_pushnil(L);
+  lua_call(L, 6, 1); // should return RenFont*
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
   }
+  lua_rawgeti(L, description, 3);
+  int idx = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  set_font_height(&client->font_heights, idx, call_font_height(L, -1));
+  lua_rawgeti(L, LUA_REGISTRYINDEX, client->font_table);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, idx);
+  lua_pop(L, 1);
   return 1;
 }
 
@@ -581,135 +4786,294 @@ static int f_client_process_event(lua_State* L) {
   luaL_checktype(L, 2, LUA_TFUNCTION); // renderer.set_clip
   luaL_checktype(L, 3, LUA_TFUNCTION); // renderer.draw_rect
   luaL_checktype(L, 4, LUA_TFUNCTION); // renderer.draw_text
-  luaL_checktype(L, 5, LUA_TFUNCTION); // font_load(path, contents, options)
-  if (client->duplex.incoming_packet_type == PACKET_NONE)
+  luaL_checktype(L, 5, LUA_TFUNCTION); // font_load(path, hash, idx, size, options, contents)
+  // 6 is begin_frame(), and 7 copy_rect(x, y, w, h, dy), both optional; whatever else is pushed goes above them.
+  lua_settop(L, 7);
+  if (!duplex_next_packet(&client->duplex)) {
+    echo_typing(L, client);
     return 0;
+  }
   int result_count = 0;
   array_t* result = &client->duplex.incoming_buffer;
   switch (client->duplex.incoming_packet_type) {
-    case PACKET_COMMAND_BUFFER: {
-      Command* command = (Command*)result->data;
-      Command* end_command = (Command*)(result->data + result->length);
-      while (command < end_command) {
-        switch (command->type) {
-          case SET_CLIP: {
-            SetClipCommand* clip = (SetClipCommand*)command;
-            lua_pushvalue(L, 2);
-            lua_pushinteger(L, clip->rect.x);
-            lua_pushinteger(L, clip->rect.y);
-            lua_pushinteger(L, clip->rect.width);
-            lua_pushinteger(L, clip->rect.height);
-            lua_call(L, 4, 0);
-          } break;
-          case DRAW_RECT: {
-            DrawRectCommand* rect = (DrawRectCommand*)command;
-            lua_pushvalue(L, 3);
-            lua_pushinteger(L, rect->rect.x);
-            lua_pushinteger(L, rect->rect.y);
-            lua_pushinteger(L, rect->rect.width);
-            lua_pushinteger(L, rect->rect.height);
-            lua_pushcolor(L, rect->color);
-            lua_call(L, 5, 0);
-          } break;
-          case DRAW_TEXT: {
-            DrawTextCommand* text = (DrawTextCommand*)command;
-            lua_pushvalue(L, 4);
-            lua_rawgeti(L, LUA_REGISTRYINDEX, client->font_table);
-            lua_rawgeti(L, -1, text->fonts[0]);
-            lua_replace(L, -2);
-            if (!lua_isnil(L, -1)) {
-              lua_pushlstring(L, text->text, text->len);
-              lua_pushnumber(L, text->text_x);
-              lua_pushnumber(L, text->y);
-              lua_pushcolor(L, text->color);
-              lua_call(L, 5, 0);
-            } else {
-              lua_pop(L, 2);
-            }
-          } break;
-        }
-        command = (Command*)(((char*)command) + command->size);
+    case PACKET_COMMAND_BUFFER:
+    case PACKET_COMMAND_DELTA: {
+      uint64_t start = get_time();
+      SFrameHeader header;
+      int status = decode_frame(&client->codec, &client->strings, &client->rencache, &client->next_rencache, &client->dirty_rects, &client->copy_rects, &client->caret, client->duplex.incoming_packet_type, result, &header);
+      if (status) {
+        fprintf(stderr, "Error: malformed frame received\n");
+        duplex_close(&client->duplex);
+        break;
       }
+      // keep the reconstructed frame around, as the next delta will be against it.
+      rencache_swap(&client->rencache, &client->next_rencache);
+      reconcile_prediction(client, &header);
+      replay_frame(L, client, header.flags & FRAME_REDRAW_ALL);
+      record_frame(&client->stats, rencache_length(&client->rencache), header.flags & FRAME_RESET, start);
+      // the server only sends a couple of frames ahead of these, so that we never show one that's long out of date.
+      ++client->received_frames;
+      array_clear(&client->duplex.outgoing_buffer);
+      array_append(&client->duplex.outgoing_buffer, &client->received_frames, sizeof(uint32_t));
+      send_compressed_buffer(&client->duplex, PACKET_FRAME_ACK, &client->duplex.outgoing_buffer);
+      array_clear(&client->duplex.outgoing_buffer);
     } break;
     case PACKET_FONT_REGISTER: {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, client->font_table);
-      lua_pushvalue(L, 5);
-      int n = pull_lua(L, result);
-      int idx = lua_tointeger(L, -3);
-      assert(n == 5); // path, contents, idx, size, options
-      lua_call(L, 5, 1); // should return RenFont*
-      lua_rawseti(L, -2, idx);
-      lua_pop(L, 1);
+      int top = lua_gettop(L);
+      ++client->font_registrations;
+      if (pull_lua(L, result) != 5) { // path, hash, idx, size, options
+        fprintf(stderr, "Error: malformed font received\n");
+        duplex_close(&client->duplex);
+        lua_settop(L, top);
+        break;
+      }
+      lua_createtable(L, 5, 0);
+      lua_insert(L, top + 1);
+      for (int i = 5; i >= 1; --i)
+        lua_rawseti(L, top + 1, i);
+      int loaded = load_font(L, client, top + 1, 0);
+      if (loaded == -1) {
+        fprintf(stderr, "Error: font received with an invalid hash\n");
+        duplex_close(&client->duplex);
+        lua_settop(L, top);
+        break;
+      }
+      if (!loaded) {
+        // not in the cache; ask for the contents, unless we already have, and load it once they're here.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, client->pending_fonts);
+        lua_rawgeti(L, top + 1, 2);
+        if (lua_rawget(L, -2) == LUA_TNIL) {
+          lua_pop(L, 1);
+          lua_newtable(L);
+          lua_rawgeti(L, top + 1, 2);
+          lua_pushvalue(L, -2);
+          lua_rawset(L, -4);
+          lua_rawgeti(L, top + 1, 2);
+          push_lua(L, 1, &client->duplex.outgoing_buffer);
+          send_compressed_buffer(&client->duplex, PACKET_FONT_REQUEST, &client->duplex.outgoing_buffer);
+          array_clear(&client->duplex.outgoing_buffer);
+          lua_pop(L, 1);
+        }
+        lua_pushvalue(L, top + 1);
+        lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+      }
+      lua_settop(L, top);
+    } break;
+    case PACKET_FONT_BLOB: {
+      int top = lua_gettop(L);
+      if (pull_lua(L, result) == 2 && lua_type(L, top + 1) == LUA_TSTRING) { // hash, contents
+        lua_rawgeti(L, LUA_REGISTRYINDEX, client->pending_fonts);
+        lua_pushvalue(L, top + 1);
+        if (lua_rawget(L, -2) == LUA_TTABLE) {
+          int pending = lua_gettop(L), count = luaL_len(L, pending);
+          // only the first load gets the contents to write to the cache; the rest find them there.
+          for (int i = 1; i <= count; ++i) {
+            lua_rawgeti(L, pending, i);
+            load_font(L, client, lua_gettop(L), i == 1 ? top + 2 : 0);
+            lua_pop(L, 1);
+          }
+          lua_pushvalue(L, top + 1);
+          lua_pushnil(L);
+          lua_rawset(L, pending - 1);
+          // whatever was drawn with these fonts so far was skipped.
+          if (rencache_length(&client->rencache))
+            replay_frame(L, client, 1);
+        }
+      }
+      lua_settop(L, top);
+    } break;
+    case PACKET_INPUT_ACK: {
+      uint32_t sequence;
+      if (result->length != sizeof(sequence)) {
+        fprintf(stderr, "Error: malformed input ack received\n");
+        duplex_close(&client->duplex);
+        break;
+      }
+      memcpy(&sequence, result->data, sizeof(sequence));
+      acknowledge_input(L, client, sequence);
     } break;
     case PACKET_EVENT:
       result_count = pull_lua(L, result);
     break;
+    // only ever sent to the server; a server sending them is broken.
+    case PACKET_EVENT_BATCH:
+    case PACKET_FRAME_ACK:
+    default:
+      fprintf(stderr, "Error: unexpected %s packet received\n", packet_type_names[client->duplex.incoming_packet_type]);
+      duplex_close(&client->duplex);
+    break;
   }
   client->duplex.incoming_packet_type = PACKET_NONE;
   return result_count;
 }
 
+// Makes the next frame redraw the whole window, for when the window's contents were lost, like on a resize.
+static int f_client_invalidate(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  client->redraw_all = 1;
+  return 0;
+}
+
+static int f_client_train_dictionary(lua_State* L) {
+  SClient* client = luaL_checkudata(L, 1, "remoteclient");
+  return train_dictionary(L, &client->duplex);
+}
+
 static const luaL_Reg client[] = {
   { "__gc",              f_client_gc                  },
   { "send_event",        f_client_send_event          },
+  { "flush_events",      f_client_flush_events        },
+  { "reconnect",         f_client_reconnect           },
+  { "compression_level", f_client_compression_level   },
+  { "stats",             f_client_stats               },
+  { "reset_stats",       f_client_reset_stats         },
+  { "record",            f_client_record              },
   { "process_event",     f_client_process_event       },
   { "has_event",         f_client_has_event           },
+  { "wait_event",        f_client_wait_event          },
   { "is_open",           f_client_is_open             },
+  { "invalidate",        f_client_invalidate          },
+  { "train_dictionary",  f_client_train_dictionary    },
   { NULL,                NULL                         }
 };
 
 
+static lua_Integer get_option_integer(lua_State* L, int idx, const char* name, lua_Integer default_value) {
+  if (!lua_istable(L, idx))
+    return default_value;
+  lua_getfield(L, idx, name);
+  lua_Integer value = luaL_optinteger(L, -1, default_value);
+  lua_pop(L, 1);
+  return value;
+}
+
+static const char* get_option_string(lua_State* L, int idx, const char* name) {
+  if (!lua_istable(L, idx))
+    return NULL;
+  lua_getfield(L, idx, name);
+  const char* value = luaL_optstring(L, -1, NULL);
+  lua_pop(L, 1);
+  return value;
+}
+
+static int get_option_boolean(lua_State* L, int idx, const char* name) {
+  if (!lua_istable(L, idx))
+    return 0;
+  lua_getfield(L, idx, name);
+  int value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+// Loads the dictionary named by the `dictionary` option, if any.
+static int load_dictionary(lua_State* L, int idx, array_t* dictionary) {
+  const char* path = get_option_string(L, idx, "dictionary");
+  if (!path)
+    return 0;
+  if (read_file(path, dictionary))
+    return luaL_error(L, "can't read dictionary %s: %s", path, strerror(errno));
+  if (!ZDICT_getDictID(dictionary->data, dictionary->length))
+    return luaL_error(L, "%s is not a zstd dictionary", path);
+  if (dictionary->length > MAX_DICTIONARY_SIZE)
+    return luaL_error(L, "%s is larger than the %d byte maximum for a dictionary", path, MAX_DICTIONARY_SIZE);
+  return 0;
+}
+
+
 static int f_server(lua_State* L) {
   const char* hostname = luaL_optstring(L, 1, NULL);
   int port = luaL_checkinteger(L, 2);
   SServer* server = lua_newuserdata(L, sizeof(SServer));
   memset(server, 0, sizeof(SServer));
   luaL_setmetatable(L, "remoteserver");
-  server->listening = socket(AF_INET, SOCK_STREAM, 0);
-  int reuse = 1;
-  setsockopt(server->listening, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-  if (!server->listening)
+  server->window_log = get_option_integer(L, 3, "window_log", DEFAULT_WINDOW_LOG);
+  server->string_table_size = get_option_integer(L, 3, "string_table_size", DEFAULT_STRING_TABLE_SIZE);
+  server->capture_samples = get_option_boolean(L, 3, "capture_samples");
+  server->codec.columnar = get_option_boolean(L, 3, "columnar_commands");
+  init_compression_levels(server->compression_levels, get_option_integer(L, 3, "compression_level", DEFAULT_COMPRESSION_LEVEL));
+  server->adaptive_compression = get_option_boolean(L, 3, "adaptive_compression");
+  server->optimize_commands = get_option_boolean(L, 3, "optimize_commands");
+  server->frame_credit = get_option_integer(L, 3, "frame_credit", DEFAULT_FRAME_CREDIT);
+  load_dictionary(L, 3, &server->dictionary);
+  generate_token(server->token);
+  lua_newtable(L);
+  server->font_blobs = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  server->font_hashes = luaL_ref(L, LUA_REGISTRYINDEX);
+  // taken before anything overrides it with server:get_width, which measures with it.
+  luaL_getmetatable(L, "Font");
+  if (lua_type(L, -1) == LUA_TTABLE)
+    lua_getfield(L, -1, "get_width");
+  else
+    lua_pushnil(L);
+  server->measure = lua_type(L, -1) == LUA_TFUNCTION ? luaL_ref(L, LUA_REGISTRYINDEX) : (lua_pop(L, 1), LUA_NOREF);
+  lua_pop(L, 1);
+  server->width_sets = get_option_integer(L, 3, "width_cache_size", DEFAULT_WIDTH_CACHE_SIZE) / WIDTH_CACHE_WAYS;
+  if (server->width_sets)
+    server->widths = calloc(server->width_sets * WIDTH_CACHE_WAYS, sizeof(SWidthEntry));
+  const char* trace = get_option_string(L, 3, "trace");
+  if (trace && trace_open(&server->trace, trace, TRACE_SERVER))
+    return luaL_error(L, "can't record to %s: %s", trace, strerror(errno));
+  int transport;
+  const char* path = hostname ? local_socket_path(hostname, &transport) : NULL;
+  server->listening = socket(path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if (server->listening == -1) {
+    server->listening = 0;
     return luaL_error(L, "can't create socket: %s", strerror(errno));
-  struct sockaddr_in host_addr = {0};
-  host_addr.sin_addr.s_addr = hostname ? inet_addr(hostname) : INADDR_ANY;
-  host_addr.sin_port = htons(port);
-  host_addr.sin_family = AF_INET;  
-  array_reserve(&server->duplex.incoming_compressed_buffer, 4096);
-  array_reserve(&server->duplex.outgoing_compressed_buffer, 4096);
-  if (bind(server->listening, (struct sockaddr*)&host_addr, sizeof(host_addr)) == -1)
-    return luaL_error(L, "can't bind: %s", strerror(errno));
-  if (listen(server->listening, 1) == -1)
+  }
+  if (path) {
+    struct sockaddr_un host_addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(host_addr.sun_path))
+      return luaL_error(L, "socket path %s is too long", path);
+    strcpy(host_addr.sun_path, path);
+    // whatever's left over from a previous run would stop us from binding; anything but a socket is left alone.
+    unlink_socket(path);
+    if (bind(server->listening, (struct sockaddr*)&host_addr, sizeof(host_addr)) == -1)
+      return luaL_error(L, "can't bind to %s: %s", path, strerror(errno));
+    strcpy(server->socket_path, path);
+  } else {
+    int reuse = 1;
+    setsockopt(server->listening, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in host_addr = {0};
+    host_addr.sin_addr.s_addr = hostname ? inet_addr(hostname) : INADDR_ANY;
+    host_addr.sin_port = htons(port);
+    host_addr.sin_family = AF_INET;
+    if (bind(server->listening, (struct sockaddr*)&host_addr, sizeof(host_addr)) == -1)
+      return luaL_error(L, "can't bind: %s", strerror(errno));
+  }
+  if (listen(server->listening, 8) == -1)
     return luaL_error(L, "can't listen: %s", strerror(errno));
   return 1;
 }
 
 
 static int f_client(lua_State* L) {
-  const char* hostname = luaL_optstring(L, 1, NULL);
+  const char* hostname = luaL_optstring(L, 1, "localhost");
   int port = luaL_checkinteger(L, 2);
   SClient* client = lua_newuserdata(L, sizeof(SClient));
   memset(client, 0, sizeof(SClient));
   luaL_setmetatable(L, "remoteclient");
-  struct hostent *host = gethostbyname(hostname);
-  if (!host)
-    return luaL_error(L, "can't resolve host %s", hostname);
-  struct sockaddr_in dest_addr = {0};
-  dest_addr.sin_family = AF_INET;
-  dest_addr.sin_port = htons(port);
-  dest_addr.sin_addr.s_addr = *(long*)(host->h_addr);
-  const char* ip = inet_ntoa(dest_addr.sin_addr);
-  client->duplex.fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (connect(client->duplex.fd, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr)) == -1 ) {
-    close(client->duplex.fd);
-    client->duplex.fd = 0;
-    return luaL_error(L, "can't connect to host %s [%s] on port %d", hostname, ip, port);
-  }
-  int flags = fcntl(client->duplex.fd, F_GETFL, 0);
-  fcntl(client->duplex.fd, F_SETFL, flags | O_NONBLOCK);
-  array_reserve(&client->duplex.incoming_compressed_buffer, 4096);
-  array_reserve(&client->duplex.outgoing_compressed_buffer, 4096);
+  client->redraw_all = 1;
+  client->coalesced.name = -1;
+  snprintf(client->hostname, sizeof(client->hostname), "%s", hostname);
+  client->port = port;
+  client->window_log = get_option_integer(L, 3, "window_log", DEFAULT_WINDOW_LOG);
+  client->string_table_size = get_option_integer(L, 3, "string_table_size", DEFAULT_STRING_TABLE_SIZE);
+  client->duplex.capture_samples = get_option_boolean(L, 3, "capture_samples");
+  init_compression_levels(client->duplex.levels, get_option_integer(L, 3, "compression_level", DEFAULT_COMPRESSION_LEVEL));
+  client->duplex.adaptive = get_option_boolean(L, 3, "adaptive_compression");
+  client->local_echo = get_option_boolean(L, 3, "local_echo");
+  load_dictionary(L, 3, &client->dictionary);
   lua_newtable(L);
   client->font_table = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  client->color_table = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  client->pending_fonts = luaL_ref(L, LUA_REGISTRYINDEX);
+  const char* trace = get_option_string(L, 3, "trace");
+  if (trace && trace_open(&client->trace, trace, TRACE_CLIENT))
+    return luaL_error(L, "can't record to %s: %s", trace, strerror(errno));
+  client_connect(L, client);
   return 1;
 }
 
@@ -741,3 +5105,308 @@ int luaopen_libtemote(lua_State* L) {
   luaL_setfuncs(L, remote, 0);
   return 1;
 }
+
+
+#ifdef LIBREMOTE_BENCHMARK
+// Replays traces recorded with server:record() or client:record() through each stage of the pipeline, with no network
+// involved, so that changes to the protocol or compression can be measured against real sessions. Frames are taken
+// from the commands a server trace recorded, or decoded from the frames a client trace received, which needs the trace
+// to be from this protocol version; every other packet going the same way is only compressed and decompressed.
+// Build with `./build.sh benchmark`.
+
+typedef struct {
+  const char* name;
+  uint64_t time;
+  size_t bytes_in;
+  size_t bytes_out;
+  size_t frames;
+} SBenchmarkStage;
+
+typedef struct {
+  EPacketType type;
+  int frame; // index into the frames, or -1 if this isn't one.
+  size_t offset; // into the encoded, and then the compressed, packets.
+  size_t length;
+  size_t compressed_offset;
+  size_t compressed_length;
+} SBenchmarkPacket;
+
+static void report_stage(SBenchmarkStage* stage) {
+  double seconds = stage->time / 1e9;
+  printf("  %-10s %12zu -> %12zu bytes %9.3fs %10.1f MB/s %10.1f frames/s   ratio %6.2f\n", stage->name, stage->bytes_in, stage->bytes_out, seconds,
+    seconds > 0 ? stage->bytes_in / seconds / 1e6 : 0, seconds > 0 ? stage->frames / seconds : 0, stage->bytes_out ? (double)stage->bytes_in / stage->bytes_out : 0);
+}
+
+// Rebuilds a frame from its commands, as a server would have drawn them; returns -1 if they're malformed.
+static int load_frame(SRencache* frame, const char* data, size_t length) {
+  rencache_clear(frame);
+  for (size_t offset = 0; offset < length; ) {
+    Command command;
+    if (length - offset < sizeof(Command))
+      return -1;
+    memcpy(&command, &data[offset], sizeof(Command));
+    if (command.size < sizeof(Command) || command.size > length - offset)
+      return -1;
+    push_command(frame, (Command*)&data[offset]);
+    offset += command.size;
+  }
+  return 0;
+}
+
+static int benchmark_trace(const char* path, int level, int window_log, int string_table_size, int columnar, int optimize, int connection) {
+  array_t contents = {0}, frames = {0}, packets = {0}, encoded = {0}, compressed = {0}, decompressed = {0}, dirty_rects = {0}, copy_rects = {0};
+  STraceHeader header;
+  if (read_file(path, &contents) || contents.length < sizeof(header)) {
+    fprintf(stderr, "Error: can't read %s\n", path);
+    return -1;
+  }
+  memcpy(&header, contents.data, sizeof(header));
+  if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    fprintf(stderr, "Error: %s isn't a trace, or is from an incompatible version\n", path);
+    free(contents.data);
+    return -1;
+  }
+  // the frames and packets going from server to client, in the order they were sent.
+  ETraceRecord direction = header.side == TRACE_SERVER ? TRACE_SENT : TRACE_RECEIVED;
+  int recorded_frames = 0, keyframe_seen = 0, undecodable = 0;
+  for (size_t offset = sizeof(header); offset + sizeof(STraceRecord) <= contents.length; ) {
+    STraceRecord record;
+    memcpy(&record, &contents.data[offset], sizeof(record));
+    offset += sizeof(record) + record.length;
+    recorded_frames |= record.kind == TRACE_FRAME;
+  }
+  SCommandCodec codec = {0};
+  SStringTable strings = {0};
+  SRencache previous = {0}, current = {0};
+  for (size_t offset = sizeof(header); offset + sizeof(STraceRecord) <= contents.length; ) {
+    STraceRecord record;
+    memcpy(&record, &contents.data[offset], sizeof(record));
+    offset += sizeof(record);
+    if (record.length > contents.length - offset) {
+      fprintf(stderr, "Warning: %s is truncated\n", path);
+      break;
+    }
+    array_t data = { 1, record.length, record.length, &contents.data[offset] };
+    offset += record.length;
+    int frame = record.type == PACKET_COMMAND_BUFFER || record.type == PACKET_COMMAND_DELTA;
+    SBenchmarkPacket packet = { record.type, -1, encoded.length, record.length };
+    if (record.kind == TRACE_FRAME) {
+      packet.frame = frames.length / sizeof(SRencache);
+      SRencache loaded = {0};
+      if (load_frame(&loaded, data.data, data.length)) {
+        fprintf(stderr, "Error: malformed frame in %s\n", path);
+        return -1;
+      }
+      array_append(&frames, &loaded, sizeof(loaded));
+    } else if (record.kind != direction || (connection != -1 && record.connection != connection) || (frame && recorded_frames)) {
+      continue;
+    } else if (frame) {
+      SFrameHeader frame_header = {0};
+      if (data.length >= sizeof(frame_header))
+        memcpy(&frame_header, data.data, sizeof(frame_header));
+      keyframe_seen |= frame_header.flags & FRAME_RESET;
+      // only the frames from the first keyframe on can be decoded.
+      if (header.protocol_version != PROTOCOL_VERSION || !keyframe_seen) {
+        ++undecodable;
+        continue;
+      }
+      if (decode_frame(&codec, &strings, &previous, &current, &dirty_rects, &copy_rects, NULL, record.type, &data, &frame_header)) {
+        fprintf(stderr, "Error: malformed frame in %s\n", path);
+        return -1;
+      }
+      rencache_swap(&previous, &current);
+      packet.frame = frames.length / sizeof(SRencache);
+      SRencache loaded = {0};
+      load_frame(&loaded, previous.buffer.data, previous.buffer.length);
+      array_append(&frames, &loaded, sizeof(loaded));
+    } else
+      array_append(&encoded, data.data, data.length);
+    if (record.kind != TRACE_FRAME)
+      connection = record.connection;
+    array_append(&packets, &packet, sizeof(packet));
+  }
+  size_t packet_count = packets.length / sizeof(SBenchmarkPacket), skipped = 0;
+  SBenchmarkPacket* packet_list = (SBenchmarkPacket*)packets.data;
+  SRencache* frame_list = (SRencache*)frames.data;
+  printf("%s: %s trace, protocol %u, %zu frames, %zu other packets", path, header.side == TRACE_SERVER ? "server" : "client", header.protocol_version,
+    frames.length / sizeof(SRencache), packet_count - frames.length / sizeof(SRencache));
+  if (undecodable)
+    printf(", %d frames that can't be decoded", undecodable);
+  printf("\n");
+
+  // encode: optimizing, diffing against the previous frame, and encoding the commands, as end_frame does.
+  SBenchmarkStage stages[4] = { { "encode" }, { "compress" }, { "decompress" }, { "decode" } };
+  SServer* server = calloc(1, sizeof(SServer));
+  server->string_table_size = string_table_size;
+  server->codec.columnar = columnar;
+  server->optimize_commands = optimize;
+  rencache_clear(&server->rencache);
+  rencache_clear(&server->previous_rencache);
+  int first = 1;
+  for (size_t i = 0; i < packet_count; ++i) {
+    SBenchmarkPacket* packet = &packet_list[i];
+    if (packet->frame == -1)
+      continue;
+    SRencache* frame = &frame_list[packet->frame];
+    rencache_clear(&server->rencache);
+    array_append(&server->rencache.buffer, frame->buffer.data, frame->buffer.length);
+    array_append(&server->rencache.commands, frame->commands.data, frame->commands.length);
+    server->rencache.checksum = frame->checksum;
+    if (!first && server->rencache.checksum == server->previous_rencache.checksum) {
+      packet->type = PACKET_NONE;
+      ++skipped;
+      continue;
+    }
+    array_clear(&server->outgoing_buffer);
+    uint64_t start = get_time();
+    if (server->optimize_commands)
+      optimize_frame(server);
+    packet->type = encode_frame(server, first, &server->outgoing_buffer);
+    stages[0].time += get_time() - start;
+    stages[0].bytes_in += frame->buffer.length;
+    // what clients decode is the optimized frame, so that's what it's checked against.
+    if (server->optimize_commands)
+      load_frame(frame, server->rencache.buffer.data, server->rencache.buffer.length);
+    stages[0].bytes_out += server->outgoing_buffer.length;
+    ++stages[0].frames;
+    packet->offset = encoded.length;
+    packet->length = server->outgoing_buffer.length;
+    array_append(&encoded, server->outgoing_buffer.data, server->outgoing_buffer.length);
+    rencache_swap(&server->rencache, &server->previous_rencache);
+    first = 0;
+  }
+
+  // compress and decompress: one stream for everything, flushed after each packet, as a connection does.
+  SDuplex duplex = {0};
+  duplex.cctx = ZSTD_createCCtx();
+  duplex.dctx = ZSTD_createDCtx();
+  ZSTD_CCtx_setParameter(duplex.cctx, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(duplex.cctx, ZSTD_c_windowLog, window_log);
+  ZSTD_DCtx_setParameter(duplex.dctx, ZSTD_d_windowLogMax, window_log);
+  for (size_t i = 0; i < packet_count; ++i) {
+    SBenchmarkPacket* packet = &packet_list[i];
+    if (packet->type == PACKET_NONE)
+      continue;
+    array_reserve(&duplex.outgoing_compressed_buffer, ZSTD_compressBound(packet->length) + PACKET_HEADER_SIZE);
+    ZSTD_inBuffer input = { &encoded.data[packet->offset], packet->length, 0 };
+    ZSTD_outBuffer output = { &duplex.outgoing_compressed_buffer.data[PACKET_HEADER_SIZE], duplex.outgoing_compressed_buffer.capacity - PACKET_HEADER_SIZE, 0 };
+    uint64_t start = get_time();
+    if (compress_stream(&duplex, &output, &input, ZSTD_e_flush))
+      return -1;
+    stages[1].time += get_time() - start;
+    stages[1].bytes_in += packet->length;
+    stages[1].bytes_out += output.pos + PACKET_HEADER_SIZE;
+    stages[1].frames += packet->frame != -1;
+    packet->compressed_offset = compressed.length;
+    packet->compressed_length = output.pos;
+    array_append(&compressed, &duplex.outgoing_compressed_buffer.data[PACKET_HEADER_SIZE], output.pos);
+  }
+  for (size_t i = 0; i < packet_count; ++i) {
+    SBenchmarkPacket* packet = &packet_list[i];
+    if (packet->type == PACKET_NONE)
+      continue;
+    decompressed.length = array_reserve(&decompressed, packet->length);
+    uint64_t start = get_time();
+    if (decompress_packet(&duplex, &compressed.data[packet->compressed_offset], packet->compressed_length, decompressed.data, decompressed.length))
+      return -1;
+    stages[2].time += get_time() - start;
+    stages[2].bytes_in += packet->compressed_length + PACKET_HEADER_SIZE;
+    stages[2].bytes_out += packet->length;
+    stages[2].frames += packet->frame != -1;
+    if (memcmp(decompressed.data, &encoded.data[packet->offset], packet->length)) {
+      fprintf(stderr, "Error: packet %zu doesn't survive compression\n", i);
+      return -1;
+    }
+  }
+
+  // decode: as a client does, checking that every frame comes out as it went in.
+  memset(&codec, 0, sizeof(codec));
+  string_table_free(&strings);
+  rencache_clear(&previous);
+  rencache_clear(&current);
+  for (size_t i = 0; i < packet_count; ++i) {
+    SBenchmarkPacket* packet = &packet_list[i];
+    if (packet->frame == -1 || packet->type == PACKET_NONE)
+      continue;
+    array_t data = { 1, packet->length, packet->length, &encoded.data[packet->offset] };
+    SFrameHeader frame_header;
+    uint64_t start = get_time();
+    int status = decode_frame(&codec, &strings, &previous, &current, &dirty_rects, &copy_rects, NULL, packet->type, &data, &frame_header);
+    stages[3].time += get_time() - start;
+    SRencache* frame = &frame_list[packet->frame];
+    if (status || current.buffer.length != frame->buffer.length || memcmp(current.buffer.data, frame->buffer.data, frame->buffer.length)) {
+      fprintf(stderr, "Error: frame %d doesn't survive encoding\n", packet->frame);
+      return -1;
+    }
+    stages[3].bytes_in += packet->length;
+    stages[3].bytes_out += current.buffer.length;
+    ++stages[3].frames;
+    rencache_swap(&previous, &current);
+  }
+  if (skipped)
+    printf("  %zu frames skipped, as unchanged\n", skipped);
+  if (optimize)
+    printf("  commands left out: %llu outside their clip, %llu covered, %llu rects merged, %llu clips\n", (unsigned long long)server->stats.outside_clip,
+      (unsigned long long)server->stats.covered, (unsigned long long)server->stats.merged_rects, (unsigned long long)server->stats.redundant_clips);
+  for (int i = 0; i < 4; ++i)
+    report_stage(&stages[i]);
+
+  ZSTD_freeCCtx(duplex.cctx);
+  ZSTD_freeDCtx(duplex.dctx);
+  free(duplex.outgoing_compressed_buffer.data);
+  for (size_t i = 0; i < frames.length / sizeof(SRencache); ++i)
+    rencache_free(&frame_list[i]);
+  rencache_free(&server->rencache);
+  rencache_free(&server->previous_rencache);
+  string_table_free(&server->strings);
+  free(server->delta_table.data);
+  free(server->delta_ops.data);
+  free(server->dirty_rects.data);
+  free(server->copy_rects.data);
+  free(server->region_moves.data);
+  free(server->sorted_previous.data);
+  free(server->sorted_current.data);
+  free(server->scroll_offsets.data);
+  free(server->shifted_command.data);
+  rencache_free(&server->optimized);
+  free(server->visible_rects.data);
+  for (int i = 0; i < STREAM_COUNT; ++i)
+    free(server->codec.streams[i].data);
+  free(server->outgoing_buffer.data);
+  free(server);
+  rencache_free(&previous);
+  rencache_free(&current);
+  string_table_free(&strings);
+  free(contents.data);
+  free(frames.data);
+  free(packets.data);
+  free(encoded.data);
+  free(compressed.data);
+  free(decompressed.data);
+  free(dirty_rects.data);
+  free(copy_rects.data);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  int level = DEFAULT_COMPRESSION_LEVEL, window_log = DEFAULT_WINDOW_LOG, string_table_size = DEFAULT_STRING_TABLE_SIZE, columnar = 0, optimize = 1, connection = -1, option;
+  while ((option = getopt(argc, argv, "l:w:s:cnk:")) != -1) {
+    switch (option) {
+      case 'l': level = atoi(optarg); break;
+      case 'w': window_log = atoi(optarg); break;
+      case 's': string_table_size = atoi(optarg); break;
+      case 'c': columnar = 1; break;
+      case 'n': optimize = 0; break;
+      case 'k': connection = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-l level] [-w window_log] [-s string_table_size] [-c] [-n] [-k connection] trace...\n"
+          "  -c  encode commands columnar\n  -n  don't optimize frames' commands before encoding them\n  -k  which of the trace's connections to replay; by default, the first one\n", argv[0]);
+        return 1;
+    }
+  }
+  int status = 0;
+  for (int i = optind; i < argc; ++i)
+    status |= benchmark_trace(argv[i], level, window_log, string_table_size, columnar, optimize, connection) != 0;
+  return status;
+}
+#endif